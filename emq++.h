@@ -34,7 +34,60 @@ extern "C"
 }
 
 #include <iostream>
+#include <sstream>
+#include <fstream>
+#include <string>
 #include <vector>
+#include <deque>
+#include <map>
+#include <set>
+#include <unordered_map>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <future>
+#include <tuple>
+#include <memory>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <cerrno>
+
+#if __cplusplus >= 201703L
+#include <memory_resource>
+#endif
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define EMQ_CRC32C_SSE42
+#elif defined(__aarch64__) && defined(__GNUC__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define EMQ_CRC32C_ARMV8
+#endif
 
 #define LIBEMQ_CPP_VERSION_MAJOR 1
 #define LIBEMQ_CPP_VERSION_MINOR 0
@@ -55,29 +108,239 @@ typedef emq_route_key RouteKey;
 typedef emq_channel Channel;
 typedef emq_msg_callback Callback;
 
+static inline uint64_t monotonic_time()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t realtime_usec()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t hash64(const void *data, size_t size, uint64_t seed = 0)
+{
+	const unsigned char *ptr = (const unsigned char*)data;
+	uint64_t hash = seed ^ (size * 0x9e3779b97f4a7c15ull);
+	uint64_t word;
+
+	while (size >= 8)
+	{
+		memcpy(&word, ptr, 8);
+		hash = (hash ^ (word * 0xbf58476d1ce4e5b9ull)) * 0x94d049bb133111ebull;
+		hash ^= hash >> 31;
+		ptr += 8;
+		size -= 8;
+	}
+
+	word = 0;
+	memcpy(&word, ptr, size);
+	hash = (hash ^ (word * 0xbf58476d1ce4e5b9ull)) * 0x94d049bb133111ebull;
+	hash ^= hash >> 29;
+	hash *= 0xbf58476d1ce4e5b9ull;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+static inline uint32_t checksum(const void *data, size_t size, uint32_t hash = 2166136261u)
+{
+	const unsigned char *ptr = (const unsigned char*)data;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ ptr[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+static inline uint32_t crc32c_portable(const void *data, size_t size, uint32_t crc)
+{
+	static const std::vector<uint32_t> table = []
+	{
+		std::vector<uint32_t> table(8 * 256);
+
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t value = i;
+
+			for (int bit = 0; bit < 8; bit++)
+			{
+				value = (value >> 1) ^ (0x82f63b78u & (0u - (value & 1)));
+			}
+
+			table[i] = value;
+		}
+
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			for (uint32_t slice = 1; slice < 8; slice++)
+			{
+				table[slice * 256 + i] = (table[(slice - 1) * 256 + i] >> 8) ^
+					table[table[(slice - 1) * 256 + i] & 0xff];
+			}
+		}
+
+		return table;
+	}();
+	const unsigned char *ptr = (const unsigned char*)data;
+	const uint32_t *t = &table[0];
+
+	crc = ~crc;
+
+	while (size >= 8)
+	{
+		uint32_t low, high;
+
+		memcpy(&low, ptr, 4);
+		memcpy(&high, ptr + 4, 4);
+		low ^= crc;
+
+		crc = t[7 * 256 + (low & 0xff)] ^ t[6 * 256 + ((low >> 8) & 0xff)] ^
+			t[5 * 256 + ((low >> 16) & 0xff)] ^ t[4 * 256 + (low >> 24)] ^
+			t[3 * 256 + (high & 0xff)] ^ t[2 * 256 + ((high >> 8) & 0xff)] ^
+			t[1 * 256 + ((high >> 16) & 0xff)] ^ t[high >> 24];
+
+		ptr += 8;
+		size -= 8;
+	}
+
+	while (size--)
+	{
+		crc = (crc >> 8) ^ t[(crc ^ *ptr++) & 0xff];
+	}
+
+	return ~crc;
+}
+
+#if defined(EMQ_CRC32C_SSE42)
+__attribute__((target("sse4.2")))
+static inline uint32_t crc32c_hardware(const void *data, size_t size, uint32_t crc)
+{
+	const unsigned char *ptr = (const unsigned char*)data;
+	uint64_t value = ~crc & 0xffffffffu;
+	uint64_t word;
+
+	while (size >= 8)
+	{
+		memcpy(&word, ptr, 8);
+		value = _mm_crc32_u64(value, word);
+		ptr += 8;
+		size -= 8;
+	}
+
+	while (size--)
+	{
+		value = _mm_crc32_u8((uint32_t)value, *ptr++);
+	}
+
+	return ~(uint32_t)value;
+}
+
+static inline bool crc32c_supported()
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(EMQ_CRC32C_ARMV8)
+__attribute__((target("+crc")))
+static inline uint32_t crc32c_hardware(const void *data, size_t size, uint32_t crc)
+{
+	const unsigned char *ptr = (const unsigned char*)data;
+	uint64_t word;
+
+	crc = ~crc;
+
+	while (size >= 8)
+	{
+		memcpy(&word, ptr, 8);
+		crc = __crc32cd(crc, word);
+		ptr += 8;
+		size -= 8;
+	}
+
+	while (size--)
+	{
+		crc = __crc32cb(crc, *ptr++);
+	}
+
+	return ~crc;
+}
+
+static inline bool crc32c_supported()
+{
+	return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#endif
+
+static inline uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0)
+{
+#if defined(EMQ_CRC32C_SSE42) || defined(EMQ_CRC32C_ARMV8)
+	static const bool hardware = crc32c_supported();
+
+	if (hardware)
+	{
+		return crc32c_hardware(data, size, crc);
+	}
+#endif
+
+	return crc32c_portable(data, size, crc);
+}
+
 class Message
 {
 public:
-	Message() : message(NULL)
+	typedef void (*Deleter)(void *context, void *data, size_t size);
+
+	Message() : message(NULL), head(0), tail(0), deleter(NULL), context(NULL)
 	{
 	}
 
-	Message(void *data, size_t size, bool zero_copy = false)
+	Message(void *data, size_t size, bool zero_copy = false) : head(0), tail(0), deleter(NULL), context(NULL)
 	{
 		message = emq_msg_create(data, size, zero_copy);
 	}
 
-	Message(emq_msg *message)
+	/* zero-copy over data, which is handed to deleter once the message is destroyed */
+	Message(void *data, size_t size, Deleter deleter, void *context) :
+		head(0), tail(0), deleter(deleter), context(context)
+	{
+		message = emq_msg_create(data, size, true);
+
+		if (!message)
+		{
+			deleter(context, data, size);
+			this->deleter = NULL;
+		}
+	}
+
+	Message(emq_msg *message, size_t head = 0, size_t tail = 0) :
+		head(head), tail(tail), deleter(NULL), context(NULL)
 	{
 		this->message = message;
 	}
 
+	Message(const struct iovec *iov, size_t count) : head(0), tail(0), deleter(NULL), context(NULL)
+	{
+		message = gather(iov, count);
+	}
+
 	~Message()
 	{
 		if (message)
 		{
+			void *data = emq_msg_data(message);
+			size_t size = emq_msg_size(message);
+
 			emq_msg_release(message);
 			message = NULL;
+
+			if (deleter)
+			{
+				deleter(context, data, size);
+			}
 		}
 	}
 
@@ -86,14 +349,25 @@ public:
 		emq_msg_expire(message, time);
 	}
 
+	Time expire()
+	{
+		return message->expire;
+	}
+
 	void *data()
 	{
-		return emq_msg_data(message);
+		return (char*)emq_msg_data(message) + head;
 	}
 
 	size_t size()
 	{
-		return emq_msg_size(message);
+		return emq_msg_size(message) - head - tail;
+	}
+
+	void strip(size_t head, size_t tail = 0)
+	{
+		this->head += head;
+		this->tail += tail;
 	}
 
 	Tag tag()
@@ -106,530 +380,7839 @@ public:
 		return message;
 	}
 
-private:
-	void operator=(const Message&);
-
-private:
-	emq_msg *message;
-};
+	/* the caller takes the message as is: a deleter set on it no longer runs */
+	emq_msg *release()
+	{
+		emq_msg *msg = message;
+		message = NULL;
+		deleter = NULL;
+		return msg;
+	}
 
-class Client
-{
-private:
-	class UserControl
+	static emq_msg *create(size_t size)
 	{
-	public:
-		inline bool create(const std::string &name, const std::string &password, Perm perm)
-		{
-			int status = emq_user_create(client, name.c_str(), password.c_str(), perm);
+		void *data = malloc(size ? size : 1);
+		emq_msg *msg;
 
-			return status == EMQ_STATUS_OK;
+		if (!data)
+		{
+			return NULL;
 		}
 
-		inline bool list(std::vector<User> &list)
+		msg = emq_msg_create(data, size, true);
+		if (!msg)
 		{
-			emq_list_iterator iter;
-			emq_list_node *node;
-			emq_list *users = emq_user_list(client);
-
-			if (!users)
-			{
-				return false;
-			}
+			free(data);
+			return NULL;
+		}
 
-			emq_list_rewind(users, &iter);
-			while ((node = emq_list_next(&iter)) != NULL)
-			{
-				list.push_back(*(User*)EMQ_LIST_VALUE(node));
-			}
+		/* libemq frees the data of messages it did not create zero-copy */
+		msg->zero_copy = 0;
 
-			emq_list_release(users);
+		return msg;
+	}
 
-			return true;
-		}
+private:
+	static emq_msg *gather(const struct iovec *iov, size_t count)
+	{
+		size_t size = 0;
+		emq_msg *msg;
+		char *data;
 
-		inline bool rename(const std::string &from, const std::string &to)
+		for (size_t i = 0; i < count; i++)
 		{
-			int status = emq_user_rename(client, from.c_str(), to.c_str());
-
-			return status == EMQ_STATUS_OK;
+			size += iov[i].iov_len;
 		}
 
-		inline bool set_perm(const std::string &name, Perm perm)
+		msg = create(size);
+		if (!msg)
 		{
-			int status = emq_user_set_perm(client, name.c_str(), perm);
-
-			return status == EMQ_STATUS_OK;
+			return NULL;
 		}
 
-		inline bool remove(const std::string &name)
-		{
-			int status = emq_user_delete(client, name.c_str());
-
-			return status == EMQ_STATUS_OK;
-		}
+		data = (char*)emq_msg_data(msg);
 
-	private:
-		void set_client(emq_client *client)
+		for (size_t i = 0; i < count; i++)
 		{
-			this->client = client;
+			memcpy(data, iov[i].iov_base, iov[i].iov_len);
+			data += iov[i].iov_len;
 		}
 
-		friend Client;
+		return msg;
+	}
 
-	private:
-		emq_client *client;
+	void operator=(const Message&);
+
+private:
+	emq_msg *message;
+	size_t head;
+	size_t tail;
+	Deleter deleter;
+	void *context;
+};
+
+class Histogram
+{
+public:
+	enum
+	{
+		BUCKETS = 64
 	};
 
-	class QueueControl
+	Histogram() : total(0), sum(0), max_value(0)
 	{
-	public:
-		inline bool create(const std::string &name, uint32_t max_msg, uint32_t max_msg_size, uint32_t flags)
-		{
-			int status = emq_queue_create(client, name.c_str(), max_msg, max_msg_size, flags);
+		std::fill(buckets, buckets + BUCKETS, 0);
+	}
 
-			return status == EMQ_STATUS_OK;
-		}
+	inline void add(uint64_t value)
+	{
+		size_t bucket = 0;
 
-		inline bool declare(const std::string &name)
+		while (bucket < BUCKETS - 1 && value >= ((uint64_t)2 << bucket))
 		{
-			int status = emq_queue_declare(client, name.c_str());
-
-			return status == EMQ_STATUS_OK;
+			bucket++;
 		}
 
-		inline bool exist(const std::string &name, int *queue_exist)
-		{
-			*queue_exist = emq_queue_exist(client, name.c_str());
+		buckets[bucket]++;
+		total++;
+		sum += value;
+		max_value = std::max(max_value, value);
+	}
 
-			return EMQ_GET_STATUS(client) == EMQ_STATUS_OK;
+	inline void merge(const Histogram &histogram)
+	{
+		for (size_t i = 0; i < BUCKETS; i++)
+		{
+			buckets[i] += histogram.buckets[i];
 		}
 
-		inline bool list(std::vector<Queue> &list)
-		{
-			emq_list_iterator iter;
-			emq_list_node *node;
-			emq_list *queues = emq_queue_list(client);
+		total += histogram.total;
+		sum += histogram.sum;
+		max_value = std::max(max_value, histogram.max_value);
+	}
 
-			if (!queues)
-			{
-				return false;
-			}
+	inline uint64_t percentile(double p) const
+	{
+		uint64_t rank = (uint64_t)(p * total / 100);
+		uint64_t seen = 0;
 
-			emq_list_rewind(queues, &iter);
-			while ((node = emq_list_next(&iter)) != NULL)
+		for (size_t i = 0; i < BUCKETS; i++)
+		{
+			seen += buckets[i];
+			if (seen > rank)
 			{
-				list.push_back(*(Queue*)EMQ_LIST_VALUE(node));
+				return std::min(max_value, ((uint64_t)2 << i) - 1);
 			}
-
-			emq_list_release(queues);
-
-			return true;
 		}
 
-		inline bool rename(const std::string &from, const std::string &to)
-		{
-			int status = emq_queue_rename(client, from.c_str(), to.c_str());
+		return max_value;
+	}
 
-			return status == EMQ_STATUS_OK;
-		}
+	inline uint64_t count() const
+	{
+		return total;
+	}
 
-		inline bool size(const std::string &name, int *queue_size)
-		{
-			*queue_size = emq_queue_size(client, name.c_str());
+	inline double mean() const
+	{
+		return total ? (double)sum / total : 0;
+	}
 
-			return *queue_size != -1;
-		}
+	inline uint64_t max() const
+	{
+		return max_value;
+	}
 
-		inline bool push(const std::string &name, Message &message)
-		{
-			int status = emq_queue_push(client, name.c_str(), message.msg());
+	inline uint64_t bucket(size_t index) const
+	{
+		return index < BUCKETS ? buckets[index] : 0;
+	}
 
-			return status == EMQ_STATUS_OK;
-		}
+private:
+	uint64_t buckets[BUCKETS];
+	uint64_t total;
+	uint64_t sum;
+	uint64_t max_value;
+};
 
-		inline Message get(const std::string &name)
-		{
-			emq_msg *msg = emq_queue_get(client, name.c_str());
+class Tracer
+{
+private:
+	struct Trailer
+	{
+		uint16_t magic;
+		uint8_t version;
+		uint8_t flags;
+		uint32_t producer;
+		uint32_t domain;
+		uint32_t reserved;
+		uint64_t sequence;
+		uint64_t timestamp;
+	};
 
-			return msg;
-		}
+	enum
+	{
+		TRAILER_MAGIC = 0x5445,
+		TRAILER_VERSION = 2
+	};
 
-		inline Message pop(const std::string &name, Time timeout)
-		{
-			emq_msg *msg = emq_queue_pop(client, name.c_str(), timeout);
+public:
+	enum
+	{
+		TRAILER_SIZE = sizeof(Trailer)
+	};
 
-			return msg;
-		}
+	struct Stats
+	{
+		Histogram residence;
+		uint64_t gaps;
+		uint64_t reorders;
+		uint64_t untraced;
+	};
 
-		inline bool confirm(const std::string &name, Tag tag)
-		{
-			int status = emq_queue_confirm(client, name.c_str(), tag);
+	Tracer(uint32_t producer) : producer(producer)
+	{
+	}
 
-			return status == EMQ_STATUS_OK;
-		}
+	inline emq_msg *wrap(const std::string &name, Message &message)
+	{
+		emq_msg *msg = Message::create(message.size() + sizeof(Trailer));
+		Trailer trailer;
 
-		inline bool subscribe(const std::string &name, uint32_t flags, Callback callback)
+		if (!msg)
 		{
-			int status = emq_queue_subscribe(client, name.c_str(), flags, callback);
-
-			return status == EMQ_STATUS_OK;
+			return NULL;
 		}
 
-		inline bool unsubscribe(const std::string &name)
+		trailer.magic = TRAILER_MAGIC;
+		trailer.version = TRAILER_VERSION;
+		trailer.flags = 0;
+		trailer.producer = producer;
+		trailer.domain = checksum(name.data(), name.size());
+		trailer.reserved = 0;
+		trailer.timestamp = realtime_usec();
+
 		{
-			int status = emq_queue_unsubscribe(client, name.c_str());
+			std::lock_guard<std::mutex> lock(mutex);
 
-			return status == EMQ_STATUS_OK;
+			trailer.sequence = ++sequences[name];
 		}
 
-		inline bool purge(const std::string &name)
-		{
-			int status = emq_queue_purge(client, name.c_str());
+		memcpy(emq_msg_data(msg), message.data(), message.size());
+		memcpy((char*)emq_msg_data(msg) + message.size(), &trailer, sizeof(trailer));
+		emq_msg_expire(msg, message.expire());
 
-			return status == EMQ_STATUS_OK;
-		}
+		return msg;
+	}
 
-		inline bool remove(const std::string &name)
-		{
-			int status = emq_queue_delete(client, name.c_str());
+	inline size_t receive(const std::string &name, const void *data, size_t size)
+	{
+		uint64_t now = realtime_usec();
+		Trailer trailer;
 
-			return status == EMQ_STATUS_OK;
+		if (size < sizeof(trailer))
+		{
+			return untraced(name);
 		}
 
-	private:
-		void set_client(emq_client *client)
+		memcpy(&trailer, (const char*)data + size - sizeof(trailer), sizeof(trailer));
+		if (trailer.magic != TRAILER_MAGIC || trailer.version != TRAILER_VERSION)
 		{
-			this->client = client;
+			return untraced(name);
 		}
 
-		friend Client;
+		std::lock_guard<std::mutex> lock(mutex);
+		Stats &queue_stats = stats_map[name];
+		uint64_t &last = last_sequences[((uint64_t)trailer.domain << 32) | trailer.producer];
 
-	private:
-		emq_client *client;
-	};
+		queue_stats.residence.add(now > trailer.timestamp ? now - trailer.timestamp : 0);
 
-	class RouteControl
-	{
-	public:
-		inline bool create(const std::string &name, uint32_t flags)
+		if (last && trailer.sequence <= last)
 		{
-			int status = emq_route_create(client, name.c_str(), flags);
-
-			return status == EMQ_STATUS_OK;
+			queue_stats.reorders++;
 		}
-
-		inline bool exist(const std::string &name, int *route_exist)
+		else
 		{
-			*route_exist = emq_route_exist(client, name.c_str());
+			if (last && trailer.sequence > last + 1)
+			{
+				queue_stats.gaps += trailer.sequence - last - 1;
+			}
 
-			return EMQ_GET_STATUS(client) == EMQ_STATUS_OK;
+			last = trailer.sequence;
 		}
 
-		inline bool list(std::vector<Route> &list)
-		{
-			emq_list_iterator iter;
-			emq_list_node *node;
-			emq_list *routes = emq_route_list(client);
-
-			if (!routes)
-			{
-				return false;
-			}
+		return sizeof(trailer);
+	}
 
-			emq_list_rewind(routes, &iter);
-			while ((node = emq_list_next(&iter)) != NULL)
-			{
-				list.push_back(*(Route*)EMQ_LIST_VALUE(node));
-			}
+	inline size_t receive(const std::string &name, emq_msg *msg, size_t tail = 0)
+	{
+		return receive(name, emq_msg_data(msg), emq_msg_size(msg) - tail);
+	}
 
-			emq_list_release(routes);
+	inline void receive(const std::string &name, Message &message)
+	{
+		message.strip(0, receive(name, message.data(), message.size()));
+	}
 
-			return true;
-		}
+	inline bool stats(const std::string &name, Stats *stats)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::map<std::string, Stats>::const_iterator it = stats_map.find(name);
 
-		inline bool keys(const std::string &name, std::vector<RouteKey> &list)
+		if (it == stats_map.end())
 		{
-			emq_list_iterator iter;
-			emq_list_node *node;
-			emq_list *keys = emq_route_keys(client, name.c_str());
-
-			if (!keys)
-			{
-				return false;
-			}
+			return false;
+		}
 
-			emq_list_rewind(keys, &iter);
-			while ((node = emq_list_next(&iter)) != NULL)
-			{
-				list.push_back(*(RouteKey*)EMQ_LIST_VALUE(node));
-			}
+		*stats = it->second;
 
-			emq_list_release(keys);
+		return true;
+	}
 
-			return true;
-		}
+private:
+	size_t untraced(const std::string &name)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
 
-		inline bool rename(const std::string &from, const std::string &to)
-		{
-			int status = emq_route_rename(client, from.c_str(), to.c_str());
+		stats_map[name].untraced++;
 
-			return status == EMQ_STATUS_OK;
-		}
+		return 0;
+	}
 
-		inline bool bind(const std::string &name, const std::string &queue, const std::string &key)
-		{
-			int status = emq_route_bind(client, name.c_str(), queue.c_str(), key.c_str());
+private:
+	Tracer(const Tracer&);
+	void operator=(const Tracer&);
 
-			return status == EMQ_STATUS_OK;
-		}
+private:
+	uint32_t producer;
+	std::mutex mutex;
+	std::unordered_map<std::string, uint64_t> sequences;
+	std::map<std::string, Stats> stats_map;
+	std::unordered_map<uint64_t, uint64_t> last_sequences;
+};
 
-		inline bool unbind(const std::string &name, const std::string &queue, const std::string &key)
-		{
-			int status = emq_route_unbind(client, name.c_str(), queue.c_str(), key.c_str());
+class Metrics
+{
+private:
+	enum
+	{
+		SLOT_SIZE = 8,
+		CACHE_SIZE = 4
+	};
 
-			return status == EMQ_STATUS_OK;
-		}
+	struct Slot
+	{
+		std::atomic<uint64_t> values[SLOT_SIZE];
+	};
 
-		inline bool push(const std::string &name, const std::string &key, Message &message)
-		{
-			int status = emq_route_push(client, name.c_str(), key.c_str(), message.msg());
+	struct Cache
+	{
+		const Metrics *owner;
+		uint64_t generation;
+		Slot *slot;
+	};
 
-			return status == EMQ_STATUS_OK;
-		}
+public:
+	enum Counter
+	{
+		OPERATIONS,
+		ERRORS,
+		BYTES_SENT,
+		BYTES_RECEIVED,
+		RECONNECTS,
+		CALLBACKS,
+		CALLBACK_TIME,
+		INFLIGHT
+	};
 
-		inline bool remove(const std::string &name)
+	class CallbackTimer
+	{
+	public:
+		CallbackTimer(Metrics *metrics) : metrics(metrics), start(std::chrono::steady_clock::now())
 		{
-			int status = emq_route_delete(client, name.c_str());
-
-			return status == EMQ_STATUS_OK;
 		}
 
-	private:
-		void set_client(emq_client *client)
+		~CallbackTimer()
 		{
-			this->client = client;
+			if (metrics)
+			{
+				metrics->add(CALLBACKS);
+				metrics->add(CALLBACK_TIME, std::chrono::duration_cast<std::chrono::microseconds>(
+					std::chrono::steady_clock::now() - start).count());
+			}
 		}
 
-		friend Client;
-
 	private:
-		emq_client *client;
+		Metrics *metrics;
+		std::chrono::steady_clock::time_point start;
 	};
 
-	class ChannelControl
+	class Operation
 	{
 	public:
-		inline bool create(const std::string &name, uint32_t flags)
+		Operation(Metrics *metrics) : metrics(metrics)
 		{
-			int status = emq_channel_create(client, name.c_str(), flags);
-
-			return status == EMQ_STATUS_OK;
+			if (metrics)
+			{
+				metrics->begin();
+			}
 		}
 
-		inline bool exist(const std::string &name, int *channel_exist)
+		~Operation()
 		{
-			*channel_exist = emq_channel_exist(client, name.c_str());
-
-			return EMQ_GET_STATUS(client) == EMQ_STATUS_OK;
+			end(false);
 		}
 
-		inline bool list(std::vector<Channel> &list)
+		inline bool end(bool status)
 		{
-			emq_list_iterator iter;
-			emq_list_node *node;
-			emq_list *channels = emq_channel_list(client);
-
-			if (!channels)
-			{
-				return false;
-			}
-
-			emq_list_rewind(channels, &iter);
-			while ((node = emq_list_next(&iter)) != NULL)
+			if (metrics)
 			{
-				list.push_back(*(Channel*)EMQ_LIST_VALUE(node));
+				metrics->end(status);
+				metrics = NULL;
 			}
 
-			emq_list_release(channels);
-
-			return true;
+			return status;
 		}
 
-		inline bool rename(const std::string &from, const std::string &to)
-		{
-			int status = emq_channel_rename(client, from.c_str(), to.c_str());
+	private:
+		Metrics *metrics;
+	};
 
-			return status == EMQ_STATUS_OK;
-		}
+	Metrics(const std::string &name = "default") : name(name), generation(next_generation()++)
+	{
+	}
 
-		inline bool publish(const std::string &name, const std::string &topic, Message &message)
+	~Metrics()
+	{
+		for (size_t i = 0; i < slots.size(); i++)
 		{
-			int status = emq_channel_publish(client, name.c_str(), topic.c_str(), message.msg());
-
-			return status == EMQ_STATUS_OK;
+			delete slots[i];
 		}
+	}
 
-		inline bool subscribe(const std::string &name, const std::string &topic, Callback callback)
-		{
-			int status = emq_channel_subscribe(client, name.c_str(), topic.c_str(), callback);
-
-			return status == EMQ_STATUS_OK;
-		}
+	inline void add(Counter counter, uint64_t value = 1)
+	{
+		std::atomic<uint64_t> &cell = slot()->values[counter];
 
-		inline bool psubscribe(const std::string &name, const std::string &pattern, Callback callback)
-		{
-			int status = emq_channel_psubscribe(client, name.c_str(), pattern.c_str(), callback);
+		cell.store(cell.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+	}
 
-			return status == EMQ_STATUS_OK;
-		}
+	inline void begin()
+	{
+		add(INFLIGHT);
+	}
 
-		inline bool unsubscribe(const std::string &name, const std::string &topic)
-		{
-			int status = emq_channel_unsubscribe(client, name.c_str(), topic.c_str());
+	inline void end(bool status, size_t sent = 0, size_t received = 0)
+	{
+		Slot *current = slot();
 
-			return status == EMQ_STATUS_OK;
-		}
+		current->values[INFLIGHT].store(current->values[INFLIGHT].load(std::memory_order_relaxed) - 1,
+			std::memory_order_relaxed);
+		add(OPERATIONS);
 
-		inline bool punsubscribe(const std::string &name, const std::string &pattern)
+		if (!status)
 		{
-			int status = emq_channel_punsubscribe(client, name.c_str(), pattern.c_str());
-
-			return status == EMQ_STATUS_OK;
+			add(ERRORS);
 		}
 
-		inline bool remove(const std::string &name)
+		if (sent)
 		{
-			int status = emq_channel_delete(client, name.c_str());
-
-			return status == EMQ_STATUS_OK;
+			add(BYTES_SENT, sent);
 		}
 
-	private:
-		void set_client(emq_client *client)
+		if (received)
 		{
-			this->client = client;
+			add(BYTES_RECEIVED, received);
 		}
+	}
 
-		friend Client;
+	inline uint64_t value(Counter counter)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		uint64_t total = 0;
 
-	private:
-		emq_client *client;
-	};
+		for (size_t i = 0; i < slots.size(); i++)
+		{
+			total += slots[i]->values[counter].load(std::memory_order_relaxed);
+		}
 
-public:
-	Client(emq_client *client)
-	{
-		this->client = client;
-		init();
+		return total;
 	}
 
-	Client(const std::string &addr, int port)
+	static void write(std::ostream &out, const std::vector<Metrics*> &list)
 	{
-		client = emq_tcp_connect(addr.c_str(), port);
-		init();
-	}
+		static const struct
+		{
+			Counter counter;
+			const char *name;
+			const char *type;
+			const char *help;
+		} series[] = {
+			{ OPERATIONS, "emq_client_operations_total", "counter", "Operations sent to the server." },
+			{ ERRORS, "emq_client_errors_total", "counter", "Operations that returned an error." },
+			{ BYTES_SENT, "emq_client_sent_bytes_total", "counter", "Message payload bytes sent." },
+			{ BYTES_RECEIVED, "emq_client_received_bytes_total", "counter", "Message payload bytes received." },
+			{ RECONNECTS, "emq_client_reconnects_total", "counter", "Connections re-established." },
+			{ CALLBACKS, "emq_client_callbacks_total", "counter", "Subscription callbacks executed." },
+			{ CALLBACK_TIME, "emq_client_callback_microseconds_total", "counter",
+				"Time spent in subscription callbacks." },
+			{ INFLIGHT, "emq_client_inflight_requests", "gauge", "Requests waiting for a reply." }
+		};
+
+		for (size_t i = 0; i < sizeof(series) / sizeof(series[0]); i++)
+		{
+			out << "# HELP " << series[i].name << " " << series[i].help << "\n";
+			out << "# TYPE " << series[i].name << " " << series[i].type << "\n";
 
-	Client(const std::string &path)
-	{
-		client = emq_unix_connect(path.c_str());
-		init();
+			for (size_t j = 0; j < list.size(); j++)
+			{
+				out << series[i].name << "{client=\"" << escape(list[j]->name) << "\"} "
+					<< (int64_t)list[j]->value(series[i].counter) << "\n";
+			}
+		}
 	}
 
-	bool connected()
+	inline void write(std::ostream &out)
 	{
-		return client != NULL;
+		write(out, std::vector<Metrics*>(1, this));
 	}
 
-	inline bool auth(const std::string &name, const std::string &password)
+	inline bool dump(const std::string &path)
 	{
-		int status = emq_auth(client, name.c_str(), password.c_str());
+		std::string tmp = path + ".tmp";
+		std::ofstream out(tmp.c_str());
 
-		return status == EMQ_STATUS_OK;
-	}
+		write(out);
+		out.close();
 
-	inline bool ping()
-	{
-		int status = emq_ping(client);
+		if (!out)
+		{
+			unlink(tmp.c_str());
+			return false;
+		}
 
-		return status == EMQ_STATUS_OK;
+		return rename(tmp.c_str(), path.c_str()) == 0;
 	}
 
-	inline bool status(Stat *stat)
+private:
+	static std::string escape(const std::string &value)
 	{
-		int status = emq_stat(client, stat);
-
-		return status == EMQ_STATUS_OK;
-	}
+		std::string result;
 
-	inline bool save(bool async)
-	{
-		int status = emq_save(client, async);
+		for (size_t i = 0; i < value.size(); i++)
+		{
+			switch (value[i])
+			{
+				case '\\':
+					result += "\\\\";
+					break;
+				case '"':
+					result += "\\\"";
+					break;
+				case '\n':
+					result += "\\n";
+					break;
+				default:
+					result += value[i];
+					break;
+			}
+		}
 
-		return status == EMQ_STATUS_OK;
+		return result;
 	}
 
-	inline bool flush(uint32_t flags)
+	static std::atomic<uint64_t> &next_generation()
 	{
-		int status = emq_flush(client, flags);
+		static std::atomic<uint64_t> generation(1);
 
-		return status == EMQ_STATUS_OK;
+		return generation;
 	}
 
-	inline void disconnect()
+	Slot *slot()
+	{
+		static thread_local Cache caches[CACHE_SIZE];
+		static thread_local size_t victim = 0;
+
+		for (size_t i = 0; i < CACHE_SIZE; i++)
+		{
+			if (caches[i].owner == this && caches[i].generation == generation)
+			{
+				return caches[i].slot;
+			}
+		}
+
+		{
+			Cache &cache = caches[victim++ % CACHE_SIZE];
+			std::lock_guard<std::mutex> lock(mutex);
+			std::thread::id id = std::this_thread::get_id();
+			std::map<std::thread::id, Slot*>::iterator it = thread_slots.find(id);
+
+			if (it == thread_slots.end())
+			{
+				Slot *slot = new Slot;
+
+				for (size_t i = 0; i < SLOT_SIZE; i++)
+				{
+					slot->values[i] = 0;
+				}
+
+				slots.push_back(slot);
+				it = thread_slots.insert(std::make_pair(id, slot)).first;
+			}
+
+			cache.owner = this;
+			cache.generation = generation;
+			cache.slot = it->second;
+
+			return cache.slot;
+		}
+	}
+
+private:
+	Metrics(const Metrics&);
+	void operator=(const Metrics&);
+
+private:
+	std::string name;
+	uint64_t generation;
+	std::mutex mutex;
+	std::vector<Slot*> slots;
+	std::map<std::thread::id, Slot*> thread_slots;
+};
+
+class MetricsServer
+{
+public:
+	MetricsServer() : fd(-1), running(false)
+	{
+	}
+
+	~MetricsServer()
+	{
+		stop();
+	}
+
+	inline void add(Metrics *metrics)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		list.push_back(metrics);
+	}
+
+	bool start(int port, const std::string &addr = "127.0.0.1")
+	{
+		struct sockaddr_in sa;
+		int reuse = 1;
+
+		if (running)
+		{
+			return false;
+		}
+
+		memset(&sa, 0, sizeof(sa));
+		sa.sin_family = AF_INET;
+		sa.sin_port = htons(port);
+
+		if (inet_pton(AF_INET, addr.c_str(), &sa.sin_addr) != 1)
+		{
+			return false;
+		}
+
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd == -1)
+		{
+			return false;
+		}
+
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+		if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) == -1 || listen(fd, 16) == -1)
+		{
+			::close(fd);
+			fd = -1;
+			return false;
+		}
+
+		running = true;
+		thread = std::thread(&MetricsServer::serve, this);
+
+		return true;
+	}
+
+	void stop()
+	{
+		if (!running)
+		{
+			return;
+		}
+
+		running = false;
+		thread.join();
+
+		::close(fd);
+		fd = -1;
+	}
+
+private:
+	void serve()
+	{
+		while (running)
+		{
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			char request[1024];
+			std::ostringstream body, response;
+			std::string data;
+			int client;
+
+			if (::poll(&pfd, 1, 100) <= 0)
+			{
+				continue;
+			}
+
+			client = accept(fd, NULL, NULL);
+			if (client == -1)
+			{
+				continue;
+			}
+
+			pfd.fd = client;
+			if (::poll(&pfd, 1, 1000) > 0 && recv(client, request, sizeof(request), 0) > 0)
+			{
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+
+					Metrics::write(body, list);
+				}
+
+				response << "HTTP/1.0 200 OK\r\n"
+					<< "Content-Type: text/plain; version=0.0.4\r\n"
+					<< "Content-Length: " << body.str().size() << "\r\n"
+					<< "Connection: close\r\n\r\n"
+					<< body.str();
+
+				data = response.str();
+				send(client, data.data(), data.size(), MSG_NOSIGNAL);
+			}
+
+			::close(client);
+		}
+	}
+
+private:
+	MetricsServer(const MetricsServer&);
+	void operator=(const MetricsServer&);
+
+private:
+	int fd;
+	std::atomic<bool> running;
+	std::thread thread;
+	std::mutex mutex;
+	std::vector<Metrics*> list;
+};
+
+class Integrity
+{
+public:
+	enum
+	{
+		TRAILER_SIZE = 4
+	};
+
+	Integrity() : sealed(0), verified(0), failed(0), dead_lettered(0)
+	{
+	}
+
+	inline emq_msg *seal(Message &message)
+	{
+		uint32_t crc = crc32c(message.data(), message.size());
+		emq_msg *msg = Message::create(message.size() + TRAILER_SIZE);
+
+		if (!msg)
+		{
+			return NULL;
+		}
+
+		memcpy(emq_msg_data(msg), message.data(), message.size());
+		memcpy((char*)emq_msg_data(msg) + message.size(), &crc, TRAILER_SIZE);
+		emq_msg_expire(msg, message.expire());
+
+		sealed++;
+
+		return msg;
+	}
+
+	inline bool verify(emq_msg *msg)
+	{
+		size_t size = emq_msg_size(msg);
+		uint32_t crc;
+
+		if (size < TRAILER_SIZE)
+		{
+			failed++;
+			return false;
+		}
+
+		memcpy(&crc, (char*)emq_msg_data(msg) + size - TRAILER_SIZE, TRAILER_SIZE);
+
+		if (crc != crc32c(emq_msg_data(msg), size - TRAILER_SIZE))
+		{
+			failed++;
+			return false;
+		}
+
+		verified++;
+
+		return true;
+	}
+
+	inline bool verify(Message &message)
+	{
+		if (!message.msg() || !verify(message.msg()))
+		{
+			return false;
+		}
+
+		message.strip(0, TRAILER_SIZE);
+
+		return true;
+	}
+
+	inline uint64_t sealed_count()
+	{
+		return sealed;
+	}
+
+	inline uint64_t verified_count()
+	{
+		return verified;
+	}
+
+	inline uint64_t failed_count()
+	{
+		return failed;
+	}
+
+	inline uint64_t dead_lettered_count()
+	{
+		return dead_lettered;
+	}
+
+	inline void set_dead_letter(const std::string &queue)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		dead_letter = queue;
+	}
+
+	/* takes a corrupt message out of circulation: copy it to the dead letter queue, then confirm it so it
+	 * is not redelivered. The caller sees an empty result; failed_count() tells it apart from no message */
+	inline void reject(emq_client *client, const std::string &name, emq_msg *msg, bool confirm)
+	{
+		std::string queue;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			queue = dead_letter;
+		}
+
+		if (!queue.empty() && emq_queue_push(client, queue.c_str(), msg) == EMQ_STATUS_OK)
+		{
+			dead_lettered++;
+		}
+
+		if (confirm)
+		{
+			emq_queue_confirm(client, name.c_str(), emq_msg_tag(msg));
+		}
+
+		emq_msg_release(msg);
+	}
+
+private:
+	Integrity(const Integrity&);
+	void operator=(const Integrity&);
+
+private:
+	std::atomic<uint64_t> sealed;
+	std::atomic<uint64_t> verified;
+	std::atomic<uint64_t> failed;
+	std::atomic<uint64_t> dead_lettered;
+	std::string dead_letter;
+	std::mutex mutex;
+};
+
+class Subscriptions
+{
+private:
+	struct Entry
+	{
+		Callback callback;
+		Tracer *tracer;
+		Integrity *integrity;
+		Metrics *metrics;
+	};
+
+public:
+	enum Kind
+	{
+		QUEUE = 'q',
+		TOPIC = 't',
+		PATTERN = 'p'
+	};
+
+	static Callback add(emq_client *client, Kind kind, const std::string &name, const std::string &topic,
+		Callback callback, Tracer *tracer, Integrity *integrity, Metrics *metrics)
+	{
+		std::lock_guard<std::mutex> lock(mutex());
+		std::string id = key(client, kind, name.c_str(), topic.c_str());
+
+		if (!tracer && !integrity && !metrics)
+		{
+			entries().erase(id);
+			return callback;
+		}
+
+		Entry &entry = entries()[id];
+
+		entry.callback = callback;
+		entry.tracer = tracer;
+		entry.integrity = integrity;
+		entry.metrics = metrics;
+
+		return unwrap;
+	}
+
+	static void remove(emq_client *client, Kind kind, const std::string &name, const std::string &topic)
+	{
+		std::lock_guard<std::mutex> lock(mutex());
+
+		entries().erase(key(client, kind, name.c_str(), topic.c_str()));
+	}
+
+	static void clear(emq_client *client)
+	{
+		std::lock_guard<std::mutex> lock(mutex());
+		std::string prefix((const char*)&client, sizeof(client));
+		std::map<std::string, Entry>::iterator it = entries().lower_bound(prefix);
+
+		while (it != entries().end() && it->first.compare(0, prefix.size(), prefix) == 0)
+		{
+			entries().erase(it++);
+		}
+	}
+
+private:
+	static std::string key(emq_client *client, char kind, const char *name, const char *topic)
+	{
+		std::string key((const char*)&client, sizeof(client));
+
+		key += kind;
+		key += name;
+		key += '\0';
+		key += topic;
+
+		return key;
+	}
+
+	static bool find(emq_client *client, char kind, const char *name, const char *topic, Entry *entry)
+	{
+		std::map<std::string, Entry>::iterator it = entries().find(key(client, kind, name, topic));
+
+		if (it == entries().end())
+		{
+			return false;
+		}
+
+		*entry = it->second;
+
+		return true;
+	}
+
+	static int unwrap(emq_client *client, int type, const char *name, const char *topic, const char *pattern,
+		emq_msg *msg)
+	{
+		Entry entry;
+		bool found;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex());
+
+			found = (pattern && *pattern && find(client, PATTERN, name, pattern, &entry)) ||
+				(topic && find(client, TOPIC, name, topic, &entry)) ||
+				find(client, QUEUE, name, "", &entry);
+		}
+
+		if (!found)
+		{
+			if (msg)
+			{
+				emq_msg_release(msg);
+			}
+
+			return 0;
+		}
+
+		/* confirming from inside the process loop is not safe, so a corrupt delivery is only dropped */
+		if (msg && entry.integrity)
+		{
+			if (!entry.integrity->verify(msg))
+			{
+				emq_msg_release(msg);
+				return 0;
+			}
+
+			msg->size -= Integrity::TRAILER_SIZE;
+		}
+
+		if (msg && entry.tracer)
+		{
+			msg->size -= entry.tracer->receive(name, msg);
+		}
+
+		Metrics::CallbackTimer timer(entry.metrics);
+
+		return entry.callback(client, type, name, topic, pattern, msg);
+	}
+
+	static std::map<std::string, Entry> &entries()
+	{
+		static std::map<std::string, Entry> map;
+
+		return map;
+	}
+
+	static std::mutex &mutex()
+	{
+		static std::mutex mutex;
+
+		return mutex;
+	}
+};
+
+struct ConnectOptions
+{
+	ConnectOptions() : nodelay(false), send_buffer(0), receive_buffer(0), busy_poll(0), keepalive(false),
+		keepalive_idle(0), keepalive_interval(0), keepalive_count(0), connect_timeout(0)
+	{
+	}
+
+	bool nodelay;
+	int send_buffer;
+	/* applied once connected; on Linux the window scale comes from tcp_rmem rather than SO_RCVBUF, so a
+	 * buffer raised after the handshake still widens the advertised window */
+	int receive_buffer;
+	int busy_poll;
+	bool keepalive;
+	int keepalive_idle;
+	int keepalive_interval;
+	int keepalive_count;
+	/* libemq creates and connects the socket itself with a blocking connect(), so this only bounds a
+	 * reachability probe made before it; a peer that stops answering in between still blocks */
+	Time connect_timeout;
+};
+
+class Recorder
+{
+public:
+	enum
+	{
+		MAGIC_SIZE = 8,
+		MAX_ARGUMENTS = 3
+	};
+
+	/* arguments: pop timeout; queue create max_msg, max_msg_size, flags; route/channel create and queue
+	 * subscribe flags. ROUTE_BIND/ROUTE_UNBIND store the queue and the key in the key field separated by a
+	 * NUL, renames store the new name there and channel subscriptions the topic or pattern. AUTH records
+	 * only the user name */
+	enum Operation
+	{
+		QUEUE_PUSH = 1,
+		QUEUE_GET,
+		QUEUE_POP,
+		QUEUE_CONFIRM,
+		ROUTE_PUSH,
+		CHANNEL_PUBLISH,
+		QUEUE_CREATE,
+		QUEUE_DECLARE,
+		QUEUE_PURGE,
+		QUEUE_REMOVE,
+		ROUTE_CREATE,
+		ROUTE_BIND,
+		ROUTE_UNBIND,
+		ROUTE_REMOVE,
+		CHANNEL_CREATE,
+		CHANNEL_REMOVE,
+		QUEUE_EXIST,
+		QUEUE_LIST,
+		QUEUE_RENAME,
+		QUEUE_SIZE,
+		QUEUE_SUBSCRIBE,
+		QUEUE_UNSUBSCRIBE,
+		ROUTE_EXIST,
+		ROUTE_LIST,
+		ROUTE_KEYS,
+		ROUTE_RENAME,
+		CHANNEL_EXIST,
+		CHANNEL_LIST,
+		CHANNEL_RENAME,
+		CHANNEL_SUBSCRIBE,
+		CHANNEL_PSUBSCRIBE,
+		CHANNEL_UNSUBSCRIBE,
+		CHANNEL_PUNSUBSCRIBE,
+		PING,
+		AUTH
+	};
+
+	struct Record
+	{
+		uint32_t size;
+		uint8_t operation;
+		uint8_t status;
+		uint16_t name_size;
+		uint16_t key_size;
+		uint16_t reserved;
+		uint32_t data_size;
+		uint32_t stored_size;
+		uint32_t arguments[MAX_ARGUMENTS];
+		uint64_t timestamp;
+	};
+
+	class Reader
+	{
+	public:
+		Reader() : file(NULL), with_payload(false)
+		{
+		}
+
+		~Reader()
+		{
+			close();
+		}
+
+		bool open(const std::string &path)
+		{
+			char magic[MAGIC_SIZE];
+
+			close();
+
+			file = fopen(path.c_str(), "rb");
+			if (!file)
+			{
+				return false;
+			}
+
+			if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, "EMQREC2", MAGIC_SIZE - 1) != 0)
+			{
+				close();
+				return false;
+			}
+
+			with_payload = magic[MAGIC_SIZE - 1] != 0;
+
+			return true;
+		}
+
+		bool next(Record *record, std::string *name, std::string *key, std::vector<char> *data)
+		{
+			if (!file || fread(record, sizeof(*record), 1, file) != 1 ||
+				record->size != sizeof(*record) + record->name_size + record->key_size + record->stored_size)
+			{
+				return false;
+			}
+
+			name->resize(record->name_size);
+			key->resize(record->key_size);
+			data->resize(record->stored_size);
+
+			return (!record->name_size || fread(&(*name)[0], record->name_size, 1, file) == 1) &&
+				(!record->key_size || fread(&(*key)[0], record->key_size, 1, file) == 1) &&
+				(!record->stored_size || fread(&(*data)[0], record->stored_size, 1, file) == 1);
+		}
+
+		void close()
+		{
+			if (file)
+			{
+				fclose(file);
+				file = NULL;
+			}
+		}
+
+		bool payload() const
+		{
+			return with_payload;
+		}
+
+	private:
+		Reader(const Reader&);
+		void operator=(const Reader&);
+
+	private:
+		FILE *file;
+		bool with_payload;
+	};
+
+	Recorder(bool payload = false, size_t buffer_size = 64 * 1024) :
+		fd(-1), payload(payload), buffer_size(buffer_size), start(0), count(0)
+	{
+	}
+
+	~Recorder()
+	{
+		close();
+	}
+
+	bool open(const std::string &path)
+	{
+		char magic[MAGIC_SIZE];
+
+		close();
+
+		fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1)
+		{
+			return false;
+		}
+
+		memcpy(magic, "EMQREC2", MAGIC_SIZE);
+		magic[MAGIC_SIZE - 1] = payload;
+
+		if (write(fd, magic, sizeof(magic)) != sizeof(magic))
+		{
+			close();
+			return false;
+		}
+
+		start = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+
+		return true;
+	}
+
+	inline void record(Operation operation, bool status, const std::string &name, const std::string &key,
+		const void *data, size_t size, const uint32_t *arguments = NULL, size_t arguments_count = 0)
+	{
+		Record record;
+		size_t offset;
+
+		memset(record.arguments, 0, sizeof(record.arguments));
+		if (arguments)
+		{
+			memcpy(record.arguments, arguments, std::min<size_t>(arguments_count, MAX_ARGUMENTS) * sizeof(*arguments));
+		}
+
+		record.operation = operation;
+		record.status = status;
+		record.name_size = std::min<size_t>(name.size(), UINT16_MAX);
+		record.key_size = std::min<size_t>(key.size(), UINT16_MAX);
+		record.reserved = 0;
+		record.data_size = size;
+		record.stored_size = payload && data ? size : 0;
+		record.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count() - start;
+		record.size = sizeof(record) + record.name_size + record.key_size + record.stored_size;
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (fd == -1)
+		{
+			return;
+		}
+
+		offset = buffer.size();
+		buffer.resize(offset + record.size);
+		memcpy(&buffer[offset], &record, sizeof(record));
+		offset += sizeof(record);
+		memcpy(&buffer[offset], name.data(), record.name_size);
+		offset += record.name_size;
+		memcpy(&buffer[offset], key.data(), record.key_size);
+		offset += record.key_size;
+
+		if (record.stored_size)
+		{
+			memcpy(&buffer[offset], data, record.stored_size);
+		}
+
+		count++;
+
+		if (buffer.size() >= buffer_size)
+		{
+			flush_buffer();
+		}
+	}
+
+	inline bool flush()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return flush_buffer();
+	}
+
+	void close()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		if (fd != -1)
+		{
+			flush_buffer();
+			::close(fd);
+			fd = -1;
+		}
+	}
+
+	inline uint64_t records()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return count;
+	}
+
+private:
+	bool flush_buffer()
+	{
+		size_t offset = 0;
+
+		while (offset < buffer.size())
+		{
+			ssize_t size = write(fd, &buffer[offset], buffer.size() - offset);
+
+			if (size <= 0)
+			{
+				buffer.clear();
+				return false;
+			}
+
+			offset += size;
+		}
+
+		buffer.clear();
+
+		return true;
+	}
+
+private:
+	Recorder(const Recorder&);
+	void operator=(const Recorder&);
+
+private:
+	int fd;
+	bool payload;
+	size_t buffer_size;
+	uint64_t start;
+	uint64_t count;
+	std::vector<char> buffer;
+	std::mutex mutex;
+};
+
+class Client;
+
+class ExistCache
+{
+private:
+	struct Entry
+	{
+		bool exist;
+		uint64_t expire;
+	};
+
+	typedef std::unordered_map<std::string, Entry> Table;
+
+public:
+	enum Kind
+	{
+		QUEUE,
+		ROUTE,
+		CHANNEL
+	};
+
+	ExistCache(Time ttl = 1000) : ttl(ttl), hit_count(0), miss_count(0)
+	{
+	}
+
+	inline bool lookup(Kind kind, const std::string &name, int *exist)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		Table::const_iterator it = tables[kind].find(name);
+
+		if (it == tables[kind].end() || it->second.expire <= monotonic_time())
+		{
+			miss_count++;
+			return false;
+		}
+
+		*exist = it->second.exist;
+		hit_count++;
+
+		return true;
+	}
+
+	inline void update(Kind kind, const std::string &name, bool exist)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		Entry &entry = tables[kind][name];
+
+		entry.exist = exist;
+		entry.expire = monotonic_time() + ttl;
+	}
+
+	inline void invalidate(Kind kind, const std::string &name)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		tables[kind].erase(name);
+	}
+
+	inline void clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		for (size_t i = 0; i < 3; i++)
+		{
+			tables[i].clear();
+		}
+	}
+
+	inline bool refresh(Client &client);
+
+	inline uint64_t hits()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return hit_count;
+	}
+
+	inline uint64_t misses()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return miss_count;
+	}
+
+	inline double hit_rate()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		uint64_t total = hit_count + miss_count;
+
+		return total ? (double)hit_count / total : 0;
+	}
+
+private:
+	void replace(Kind kind, const std::vector<std::string> &names)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		uint64_t expire = monotonic_time() + ttl;
+		Table &table = tables[kind];
+
+		for (Table::iterator it = table.begin(); it != table.end(); ++it)
+		{
+			it->second.exist = false;
+			it->second.expire = expire;
+		}
+
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			Entry &entry = table[names[i]];
+
+			entry.exist = true;
+			entry.expire = expire;
+		}
+	}
+
+private:
+	ExistCache(const ExistCache&);
+	void operator=(const ExistCache&);
+
+private:
+	Time ttl;
+	Table tables[3];
+	std::mutex mutex;
+	uint64_t hit_count;
+	uint64_t miss_count;
+};
+
+class Client
+{
+private:
+	class UserControl
+	{
+	public:
+		inline bool create(const std::string &name, const std::string &password, Perm perm)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_user_create(client, name.c_str(), password.c_str(), perm);
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		template <typename Allocator>
+		inline bool list(std::vector<User, Allocator> &list)
+		{
+			Metrics::Operation operation(metrics);
+			emq_list_iterator iter;
+			emq_list_node *node;
+			emq_list *users = emq_user_list(client);
+
+			if (!users)
+			{
+				return operation.end(false);
+			}
+
+			emq_list_rewind(users, &iter);
+			while ((node = emq_list_next(&iter)) != NULL)
+			{
+				list.push_back(*(User*)EMQ_LIST_VALUE(node));
+			}
+
+			emq_list_release(users);
+
+			return operation.end(true);
+		}
+
+		inline bool rename(const std::string &from, const std::string &to)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_user_rename(client, from.c_str(), to.c_str());
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool set_perm(const std::string &name, Perm perm)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_user_set_perm(client, name.c_str(), perm);
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool remove(const std::string &name)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_user_delete(client, name.c_str());
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+	private:
+		void set_client(emq_client *client)
+		{
+			this->client = client;
+		}
+
+		void set_metrics(Metrics *metrics)
+		{
+			this->metrics = metrics;
+		}
+
+		friend Client;
+
+	private:
+		emq_client *client;
+		Metrics *metrics;
+	};
+
+	class QueueControl
+	{
+	public:
+		inline bool create(const std::string &name, uint32_t max_msg, uint32_t max_msg_size, uint32_t flags)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_queue_create(client, name.c_str(), max_msg, max_msg_size, flags);
+
+			if (cache && status == EMQ_STATUS_OK)
+			{
+				cache->update(ExistCache::QUEUE, name, true);
+			}
+
+			if (recorder)
+			{
+				uint32_t arguments[] = { max_msg, max_msg_size, flags };
+
+				recorder->record(Recorder::QUEUE_CREATE, status == EMQ_STATUS_OK, name, std::string(), NULL, 0,
+					arguments, sizeof(arguments) / sizeof(arguments[0]));
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool declare(const std::string &name)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_queue_declare(client, name.c_str());
+
+			if (cache && status == EMQ_STATUS_OK)
+			{
+				cache->update(ExistCache::QUEUE, name, true);
+			}
+
+			if (recorder)
+			{
+				recorder->record(Recorder::QUEUE_DECLARE, status == EMQ_STATUS_OK, name, std::string(), NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool exist(const std::string &name, int *queue_exist)
+		{
+			if (cache && cache->lookup(ExistCache::QUEUE, name, queue_exist))
+			{
+				return true;
+			}
+
+			Metrics::Operation operation(metrics);
+
+			*queue_exist = emq_queue_exist(client, name.c_str());
+
+			if (recorder)
+			{
+				recorder->record(Recorder::QUEUE_EXIST, EMQ_GET_STATUS(client) == EMQ_STATUS_OK, name, std::string(), NULL, 0);
+			}
+
+			if (EMQ_GET_STATUS(client) != EMQ_STATUS_OK)
+			{
+				return operation.end(false);
+			}
+
+			if (cache)
+			{
+				cache->update(ExistCache::QUEUE, name, *queue_exist != 0);
+			}
+
+			return operation.end(true);
+		}
+
+		template <typename Allocator>
+		inline bool list(std::vector<Queue, Allocator> &list)
+		{
+			Metrics::Operation operation(metrics);
+			emq_list_iterator iter;
+			emq_list_node *node;
+			emq_list *queues = emq_queue_list(client);
+
+			if (recorder)
+			{
+				recorder->record(Recorder::QUEUE_LIST, queues != NULL, std::string(), std::string(), NULL, 0);
+			}
+
+			if (!queues)
+			{
+				return operation.end(false);
+			}
+
+			emq_list_rewind(queues, &iter);
+			while ((node = emq_list_next(&iter)) != NULL)
+			{
+				list.push_back(*(Queue*)EMQ_LIST_VALUE(node));
+			}
+
+			emq_list_release(queues);
+
+			return operation.end(true);
+		}
+
+		inline bool rename(const std::string &from, const std::string &to)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_queue_rename(client, from.c_str(), to.c_str());
+
+			if (cache && status == EMQ_STATUS_OK)
+			{
+				cache->update(ExistCache::QUEUE, from, false);
+				cache->update(ExistCache::QUEUE, to, true);
+			}
+
+			if (recorder)
+			{
+				recorder->record(Recorder::QUEUE_RENAME, status == EMQ_STATUS_OK, from, to, NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool size(const std::string &name, int *queue_size)
+		{
+			Metrics::Operation operation(metrics);
+			*queue_size = emq_queue_size(client, name.c_str());
+
+			if (recorder)
+			{
+				recorder->record(Recorder::QUEUE_SIZE, *queue_size != -1, name, std::string(), NULL, 0);
+			}
+
+			return operation.end(*queue_size != -1);
+		}
+
+		inline bool push(const std::string &name, Message &message)
+		{
+			int status;
+
+			if (metrics)
+			{
+				metrics->begin();
+			}
+
+			Message traced(tracer ? tracer->wrap(name, message) : NULL);
+			Message &payload = traced.msg() ? traced : message;
+			Message sealed(integrity ? integrity->seal(payload) : NULL);
+
+			status = emq_queue_push(client, name.c_str(), (sealed.msg() ? sealed : payload).msg());
+
+			if (metrics)
+			{
+				metrics->end(status == EMQ_STATUS_OK, message.size());
+			}
+
+			if (recorder)
+			{
+				recorder->record(Recorder::QUEUE_PUSH, status == EMQ_STATUS_OK, name, std::string(),
+					message.data(), message.size());
+			}
+
+			return status == EMQ_STATUS_OK;
+		}
+
+		inline bool push(const std::string &name, const struct iovec *iov, size_t count)
+		{
+			Message message(iov, count);
+
+			return message.msg() && push(name, message);
+		}
+
+		inline Message get(const std::string &name)
+		{
+			emq_msg *msg;
+
+			if (metrics)
+			{
+				metrics->begin();
+			}
+
+			msg = emq_queue_get(client, name.c_str());
+
+			if (metrics)
+			{
+				metrics->end(msg != NULL, 0, msg ? emq_msg_size(msg) : 0);
+			}
+
+			if (recorder)
+			{
+				recorder->record(Recorder::QUEUE_GET, msg != NULL, name, std::string(), NULL,
+					msg ? emq_msg_size(msg) : 0);
+			}
+
+			/* get() does not take the message, so a corrupt one stays at the head for pop() to reject */
+			if (msg && integrity && !integrity->verify(msg))
+			{
+				emq_msg_release(msg);
+				msg = NULL;
+			}
+
+			if (msg && (tracer || integrity))
+			{
+				size_t tail = integrity ? Integrity::TRAILER_SIZE : 0;
+
+				return Message(msg, 0, tail + (tracer ? tracer->receive(name, msg, tail) : 0));
+			}
+
+			return msg;
+		}
+
+		inline Message pop(const std::string &name, Time timeout)
+		{
+			emq_msg *msg;
+
+			if (metrics)
+			{
+				metrics->begin();
+			}
+
+			msg = emq_queue_pop(client, name.c_str(), timeout);
+
+			if (metrics)
+			{
+				metrics->end(msg != NULL, 0, msg ? emq_msg_size(msg) : 0);
+			}
+
+			if (recorder)
+			{
+				uint32_t arguments[] = { (uint32_t)timeout };
+
+				recorder->record(Recorder::QUEUE_POP, msg != NULL, name, std::string(), NULL,
+					msg ? emq_msg_size(msg) : 0, arguments, 1);
+			}
+
+			if (msg && integrity && !integrity->verify(msg))
+			{
+				integrity->reject(client, name, msg, timeout != 0);
+				msg = NULL;
+			}
+
+			if (msg && (tracer || integrity))
+			{
+				size_t tail = integrity ? Integrity::TRAILER_SIZE : 0;
+
+				return Message(msg, 0, tail + (tracer ? tracer->receive(name, msg, tail) : 0));
+			}
+
+			return msg;
+		}
+
+		inline bool confirm(const std::string &name, Tag tag)
+		{
+			int status;
+
+			if (metrics)
+			{
+				metrics->begin();
+			}
+
+			status = emq_queue_confirm(client, name.c_str(), tag);
+
+			if (metrics)
+			{
+				metrics->end(status == EMQ_STATUS_OK);
+			}
+
+			if (recorder)
+			{
+				recorder->record(Recorder::QUEUE_CONFIRM, status == EMQ_STATUS_OK, name, std::string(), NULL, 0);
+			}
+
+			return status == EMQ_STATUS_OK;
+		}
+
+		inline bool subscribe(const std::string &name, uint32_t flags, Callback callback)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_queue_subscribe(client, name.c_str(), flags, Subscriptions::add(client,
+				Subscriptions::QUEUE, name, std::string(), callback, tracer, integrity, metrics));
+
+			if (recorder)
+			{
+				uint32_t arguments[] = { flags };
+
+				recorder->record(Recorder::QUEUE_SUBSCRIBE, status == EMQ_STATUS_OK, name, std::string(), NULL, 0,
+					arguments, sizeof(arguments) / sizeof(arguments[0]));
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool unsubscribe(const std::string &name)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_queue_unsubscribe(client, name.c_str());
+
+			Subscriptions::remove(client, Subscriptions::QUEUE, name, std::string());
+
+			if (recorder)
+			{
+				recorder->record(Recorder::QUEUE_UNSUBSCRIBE, status == EMQ_STATUS_OK, name, std::string(), NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool purge(const std::string &name)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_queue_purge(client, name.c_str());
+
+			if (recorder)
+			{
+				recorder->record(Recorder::QUEUE_PURGE, status == EMQ_STATUS_OK, name, std::string(), NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool remove(const std::string &name)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_queue_delete(client, name.c_str());
+
+			if (cache && status == EMQ_STATUS_OK)
+			{
+				cache->update(ExistCache::QUEUE, name, false);
+			}
+
+			if (recorder)
+			{
+				recorder->record(Recorder::QUEUE_REMOVE, status == EMQ_STATUS_OK, name, std::string(), NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		/* bytes the installed hooks append to every pushed message */
+		inline size_t overhead()
+		{
+			return (tracer ? (size_t)Tracer::TRAILER_SIZE : 0) + (integrity ? (size_t)Integrity::TRAILER_SIZE : 0);
+		}
+
+	private:
+		void set_client(emq_client *client)
+		{
+			this->client = client;
+		}
+
+		void set_cache(ExistCache *cache)
+		{
+			this->cache = cache;
+		}
+
+		void set_tracer(Tracer *tracer)
+		{
+			this->tracer = tracer;
+		}
+
+		void set_metrics(Metrics *metrics)
+		{
+			this->metrics = metrics;
+		}
+
+		void set_recorder(Recorder *recorder)
+		{
+			this->recorder = recorder;
+		}
+
+		void set_integrity(Integrity *integrity)
+		{
+			this->integrity = integrity;
+		}
+
+		friend Client;
+
+	private:
+		emq_client *client;
+		ExistCache *cache;
+		Tracer *tracer;
+		Metrics *metrics;
+		Recorder *recorder;
+		Integrity *integrity;
+	};
+
+	class RouteControl
+	{
+	public:
+		inline bool create(const std::string &name, uint32_t flags)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_route_create(client, name.c_str(), flags);
+
+			if (cache && status == EMQ_STATUS_OK)
+			{
+				cache->update(ExistCache::ROUTE, name, true);
+			}
+
+			if (recorder)
+			{
+				uint32_t arguments[] = { flags };
+
+				recorder->record(Recorder::ROUTE_CREATE, status == EMQ_STATUS_OK, name, std::string(), NULL, 0,
+					arguments, sizeof(arguments) / sizeof(arguments[0]));
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool exist(const std::string &name, int *route_exist)
+		{
+			if (cache && cache->lookup(ExistCache::ROUTE, name, route_exist))
+			{
+				return true;
+			}
+
+			Metrics::Operation operation(metrics);
+
+			*route_exist = emq_route_exist(client, name.c_str());
+
+			if (recorder)
+			{
+				recorder->record(Recorder::ROUTE_EXIST, EMQ_GET_STATUS(client) == EMQ_STATUS_OK, name, std::string(), NULL, 0);
+			}
+
+			if (EMQ_GET_STATUS(client) != EMQ_STATUS_OK)
+			{
+				return operation.end(false);
+			}
+
+			if (cache)
+			{
+				cache->update(ExistCache::ROUTE, name, *route_exist != 0);
+			}
+
+			return operation.end(true);
+		}
+
+		template <typename Allocator>
+		inline bool list(std::vector<Route, Allocator> &list)
+		{
+			Metrics::Operation operation(metrics);
+			emq_list_iterator iter;
+			emq_list_node *node;
+			emq_list *routes = emq_route_list(client);
+
+			if (recorder)
+			{
+				recorder->record(Recorder::ROUTE_LIST, routes != NULL, std::string(), std::string(), NULL, 0);
+			}
+
+			if (!routes)
+			{
+				return operation.end(false);
+			}
+
+			emq_list_rewind(routes, &iter);
+			while ((node = emq_list_next(&iter)) != NULL)
+			{
+				list.push_back(*(Route*)EMQ_LIST_VALUE(node));
+			}
+
+			emq_list_release(routes);
+
+			return operation.end(true);
+		}
+
+		template <typename Allocator>
+		inline bool keys(const std::string &name, std::vector<RouteKey, Allocator> &list)
+		{
+			Metrics::Operation operation(metrics);
+			emq_list_iterator iter;
+			emq_list_node *node;
+			emq_list *keys = emq_route_keys(client, name.c_str());
+
+			if (recorder)
+			{
+				recorder->record(Recorder::ROUTE_KEYS, keys != NULL, name, std::string(), NULL, 0);
+			}
+
+			if (!keys)
+			{
+				return operation.end(false);
+			}
+
+			emq_list_rewind(keys, &iter);
+			while ((node = emq_list_next(&iter)) != NULL)
+			{
+				list.push_back(*(RouteKey*)EMQ_LIST_VALUE(node));
+			}
+
+			emq_list_release(keys);
+
+			return operation.end(true);
+		}
+
+		inline bool rename(const std::string &from, const std::string &to)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_route_rename(client, from.c_str(), to.c_str());
+
+			if (cache && status == EMQ_STATUS_OK)
+			{
+				cache->update(ExistCache::ROUTE, from, false);
+				cache->update(ExistCache::ROUTE, to, true);
+			}
+
+			if (recorder)
+			{
+				recorder->record(Recorder::ROUTE_RENAME, status == EMQ_STATUS_OK, from, to, NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool bind(const std::string &name, const std::string &queue, const std::string &key)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_route_bind(client, name.c_str(), queue.c_str(), key.c_str());
+
+			if (recorder)
+			{
+				recorder->record(Recorder::ROUTE_BIND, status == EMQ_STATUS_OK, name, queue + std::string(1, '\0') + key,
+					NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool unbind(const std::string &name, const std::string &queue, const std::string &key)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_route_unbind(client, name.c_str(), queue.c_str(), key.c_str());
+
+			if (recorder)
+			{
+				recorder->record(Recorder::ROUTE_UNBIND, status == EMQ_STATUS_OK, name, queue + std::string(1, '\0') + key,
+					NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool push(const std::string &name, const std::string &key, Message &message)
+		{
+			int status;
+
+			if (metrics)
+			{
+				metrics->begin();
+			}
+
+			Message traced(tracer ? tracer->wrap(name + "/" + key, message) : NULL);
+			Message &payload = traced.msg() ? traced : message;
+			Message sealed(integrity ? integrity->seal(payload) : NULL);
+
+			status = emq_route_push(client, name.c_str(), key.c_str(), (sealed.msg() ? sealed : payload).msg());
+
+			if (metrics)
+			{
+				metrics->end(status == EMQ_STATUS_OK, message.size());
+			}
+
+			if (recorder)
+			{
+				recorder->record(Recorder::ROUTE_PUSH, status == EMQ_STATUS_OK, name, key,
+					message.data(), message.size());
+			}
+
+			return status == EMQ_STATUS_OK;
+		}
+
+		inline bool push(const std::string &name, const std::string &key, const struct iovec *iov, size_t count)
+		{
+			Message message(iov, count);
+
+			return message.msg() && push(name, key, message);
+		}
+
+		inline bool remove(const std::string &name)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_route_delete(client, name.c_str());
+
+			if (cache && status == EMQ_STATUS_OK)
+			{
+				cache->update(ExistCache::ROUTE, name, false);
+			}
+
+			if (recorder)
+			{
+				recorder->record(Recorder::ROUTE_REMOVE, status == EMQ_STATUS_OK, name, std::string(), NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+	private:
+		void set_client(emq_client *client)
+		{
+			this->client = client;
+		}
+
+		void set_cache(ExistCache *cache)
+		{
+			this->cache = cache;
+		}
+
+		void set_tracer(Tracer *tracer)
+		{
+			this->tracer = tracer;
+		}
+
+		void set_metrics(Metrics *metrics)
+		{
+			this->metrics = metrics;
+		}
+
+		void set_recorder(Recorder *recorder)
+		{
+			this->recorder = recorder;
+		}
+
+		void set_integrity(Integrity *integrity)
+		{
+			this->integrity = integrity;
+		}
+
+		friend Client;
+
+	private:
+		emq_client *client;
+		ExistCache *cache;
+		Tracer *tracer;
+		Metrics *metrics;
+		Recorder *recorder;
+		Integrity *integrity;
+	};
+
+	class ChannelControl
+	{
+	public:
+		inline bool create(const std::string &name, uint32_t flags)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_channel_create(client, name.c_str(), flags);
+
+			if (cache && status == EMQ_STATUS_OK)
+			{
+				cache->update(ExistCache::CHANNEL, name, true);
+			}
+
+			if (recorder)
+			{
+				uint32_t arguments[] = { flags };
+
+				recorder->record(Recorder::CHANNEL_CREATE, status == EMQ_STATUS_OK, name, std::string(), NULL, 0,
+					arguments, sizeof(arguments) / sizeof(arguments[0]));
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool exist(const std::string &name, int *channel_exist)
+		{
+			if (cache && cache->lookup(ExistCache::CHANNEL, name, channel_exist))
+			{
+				return true;
+			}
+
+			Metrics::Operation operation(metrics);
+
+			*channel_exist = emq_channel_exist(client, name.c_str());
+
+			if (recorder)
+			{
+				recorder->record(Recorder::CHANNEL_EXIST, EMQ_GET_STATUS(client) == EMQ_STATUS_OK, name, std::string(), NULL, 0);
+			}
+
+			if (EMQ_GET_STATUS(client) != EMQ_STATUS_OK)
+			{
+				return operation.end(false);
+			}
+
+			if (cache)
+			{
+				cache->update(ExistCache::CHANNEL, name, *channel_exist != 0);
+			}
+
+			return operation.end(true);
+		}
+
+		template <typename Allocator>
+		inline bool list(std::vector<Channel, Allocator> &list)
+		{
+			Metrics::Operation operation(metrics);
+			emq_list_iterator iter;
+			emq_list_node *node;
+			emq_list *channels = emq_channel_list(client);
+
+			if (recorder)
+			{
+				recorder->record(Recorder::CHANNEL_LIST, channels != NULL, std::string(), std::string(), NULL, 0);
+			}
+
+			if (!channels)
+			{
+				return operation.end(false);
+			}
+
+			emq_list_rewind(channels, &iter);
+			while ((node = emq_list_next(&iter)) != NULL)
+			{
+				list.push_back(*(Channel*)EMQ_LIST_VALUE(node));
+			}
+
+			emq_list_release(channels);
+
+			return operation.end(true);
+		}
+
+		inline bool rename(const std::string &from, const std::string &to)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_channel_rename(client, from.c_str(), to.c_str());
+
+			if (cache && status == EMQ_STATUS_OK)
+			{
+				cache->update(ExistCache::CHANNEL, from, false);
+				cache->update(ExistCache::CHANNEL, to, true);
+			}
+
+			if (recorder)
+			{
+				recorder->record(Recorder::CHANNEL_RENAME, status == EMQ_STATUS_OK, from, to, NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool publish(const std::string &name, const std::string &topic, Message &message)
+		{
+			int status;
+
+			if (metrics)
+			{
+				metrics->begin();
+			}
+
+			Message traced(tracer ? tracer->wrap(name + "/" + topic, message) : NULL);
+			Message &payload = traced.msg() ? traced : message;
+			Message sealed(integrity ? integrity->seal(payload) : NULL);
+
+			status = emq_channel_publish(client, name.c_str(), topic.c_str(), (sealed.msg() ? sealed : payload).msg());
+
+			if (metrics)
+			{
+				metrics->end(status == EMQ_STATUS_OK, message.size());
+			}
+
+			if (recorder)
+			{
+				recorder->record(Recorder::CHANNEL_PUBLISH, status == EMQ_STATUS_OK, name, topic,
+					message.data(), message.size());
+			}
+
+			return status == EMQ_STATUS_OK;
+		}
+
+		inline bool publish(const std::string &name, const std::string &topic, const struct iovec *iov, size_t count)
+		{
+			Message message(iov, count);
+
+			return message.msg() && publish(name, topic, message);
+		}
+
+		inline bool subscribe(const std::string &name, const std::string &topic, Callback callback)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_channel_subscribe(client, name.c_str(), topic.c_str(), Subscriptions::add(client,
+				Subscriptions::TOPIC, name, topic, callback, tracer, integrity, metrics));
+
+			if (recorder)
+			{
+				recorder->record(Recorder::CHANNEL_SUBSCRIBE, status == EMQ_STATUS_OK, name, topic, NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool psubscribe(const std::string &name, const std::string &pattern, Callback callback)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_channel_psubscribe(client, name.c_str(), pattern.c_str(), Subscriptions::add(client,
+				Subscriptions::PATTERN, name, pattern, callback, tracer, integrity, metrics));
+
+			if (recorder)
+			{
+				recorder->record(Recorder::CHANNEL_PSUBSCRIBE, status == EMQ_STATUS_OK, name, pattern, NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool unsubscribe(const std::string &name, const std::string &topic)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_channel_unsubscribe(client, name.c_str(), topic.c_str());
+
+			Subscriptions::remove(client, Subscriptions::TOPIC, name, topic);
+
+			if (recorder)
+			{
+				recorder->record(Recorder::CHANNEL_UNSUBSCRIBE, status == EMQ_STATUS_OK, name, topic, NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool punsubscribe(const std::string &name, const std::string &pattern)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_channel_punsubscribe(client, name.c_str(), pattern.c_str());
+
+			Subscriptions::remove(client, Subscriptions::PATTERN, name, pattern);
+
+			if (recorder)
+			{
+				recorder->record(Recorder::CHANNEL_PUNSUBSCRIBE, status == EMQ_STATUS_OK, name, pattern, NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+		inline bool remove(const std::string &name)
+		{
+			Metrics::Operation operation(metrics);
+			int status = emq_channel_delete(client, name.c_str());
+
+			if (cache && status == EMQ_STATUS_OK)
+			{
+				cache->update(ExistCache::CHANNEL, name, false);
+			}
+
+			if (recorder)
+			{
+				recorder->record(Recorder::CHANNEL_REMOVE, status == EMQ_STATUS_OK, name, std::string(), NULL, 0);
+			}
+
+			return operation.end(status == EMQ_STATUS_OK);
+		}
+
+	private:
+		void set_client(emq_client *client)
+		{
+			this->client = client;
+		}
+
+		void set_cache(ExistCache *cache)
+		{
+			this->cache = cache;
+		}
+
+		void set_tracer(Tracer *tracer)
+		{
+			this->tracer = tracer;
+		}
+
+		void set_metrics(Metrics *metrics)
+		{
+			this->metrics = metrics;
+		}
+
+		void set_recorder(Recorder *recorder)
+		{
+			this->recorder = recorder;
+		}
+
+		void set_integrity(Integrity *integrity)
+		{
+			this->integrity = integrity;
+		}
+
+		friend Client;
+
+	private:
+		emq_client *client;
+		ExistCache *cache;
+		Tracer *tracer;
+		Metrics *metrics;
+		Recorder *recorder;
+		Integrity *integrity;
+	};
+
+public:
+	Client(emq_client *client) : port(0)
+	{
+		this->client = client;
+		init();
+	}
+
+	Client(const std::string &addr, int port) : addr(addr), port(port)
+	{
+		client = open();
+		init();
+	}
+
+	Client(const std::string &path) : port(0), path(path)
+	{
+		client = open();
+		init();
+	}
+
+	Client(const std::string &addr, int port, const ConnectOptions &options) :
+		addr(addr), port(port), options(options)
+	{
+		client = open();
+		init();
+		set_options(options);
+	}
+
+	Client(const std::string &path, const ConnectOptions &options) : port(0), path(path), options(options)
+	{
+		client = open();
+		init();
+		set_options(options);
+	}
+
+	bool connected()
+	{
+		return client != NULL;
+	}
+
+	int fd()
+	{
+		return client ? client->fd : -1;
+	}
+
+	/* responses libemq has read off the socket but not yet handed to process() */
+	bool buffered()
+	{
+		return client && client->response && client->response->pos < client->response->size;
+	}
+
+	inline bool auth(const std::string &name, const std::string &password)
+	{
+		Metrics::Operation operation(metrics);
+		int status = emq_auth(client, name.c_str(), password.c_str());
+
+		if (recorder)
+		{
+			recorder->record(Recorder::AUTH, status == EMQ_STATUS_OK, name, std::string(), NULL, 0);
+		}
+
+		return operation.end(status == EMQ_STATUS_OK);
+	}
+
+	inline bool ping()
+	{
+		Metrics::Operation operation(metrics);
+		int status = emq_ping(client);
+
+		if (recorder)
+		{
+			recorder->record(Recorder::PING, status == EMQ_STATUS_OK, std::string(), std::string(), NULL, 0);
+		}
+
+		return operation.end(status == EMQ_STATUS_OK);
+	}
+
+	inline bool status(Stat *stat)
+	{
+		Metrics::Operation operation(metrics);
+		int status = emq_stat(client, stat);
+
+		return operation.end(status == EMQ_STATUS_OK);
+	}
+
+	inline bool save(bool async)
+	{
+		Metrics::Operation operation(metrics);
+		int status = emq_save(client, async);
+
+		return operation.end(status == EMQ_STATUS_OK);
+	}
+
+	inline bool flush(uint32_t flags)
+	{
+		Metrics::Operation operation(metrics);
+		int status = emq_flush(client, flags);
+
+		return operation.end(status == EMQ_STATUS_OK);
+	}
+
+	inline void disconnect()
+	{
+		if (client)
+		{
+			Subscriptions::clear(client);
+			emq_disconnect(client);
+			client = NULL;
+		}
+	}
+
+	inline bool reconnect()
+	{
+		emq_client *connection;
+
+		if (addr.empty() && path.empty())
+		{
+			return false;
+		}
+
+		connection = open();
+		if (!connection)
+		{
+			return false;
+		}
+
+		disconnect();
+		client = connection;
+
+		user.set_client(client);
+		queue.set_client(client);
+		route.set_client(client);
+		channel.set_client(client);
+		set_options(options);
+
+		if (metrics)
+		{
+			metrics->add(Metrics::RECONNECTS);
+		}
+
+		return true;
+	}
+
+	inline int process()
+	{
+		int status = emq_process(client);
+
+		return status == EMQ_STATUS_OK;
+	}
+
+	inline void set_noack_mode(bool mode)
+	{
+		if (mode)
+		{
+			emq_noack_enable(client);
+		}
+		else
+		{
+			emq_noack_disable(client);
+		}
+	}
+
+	inline std::string last_error()
+	{
+		return emq_last_error(client);
+	}
+
+	template <typename Allocator>
+	inline void last_error(std::basic_string<char, std::char_traits<char>, Allocator> &error)
+	{
+		error.assign(emq_last_error(client));
+	}
+
+#if __cplusplus >= 201703L
+	inline std::pmr::string last_error(std::pmr::memory_resource *resource)
+	{
+		return std::pmr::string(emq_last_error(client), resource);
+	}
+
+	inline void set_memory_resource(std::pmr::memory_resource *resource)
+	{
+		this->resource = resource;
+	}
+
+	inline std::pmr::memory_resource *memory_resource()
+	{
+		return resource ? (std::pmr::memory_resource*)resource : std::pmr::get_default_resource();
+	}
+
+	/* only the payload comes from the resource and goes back to it with the message; the emq_msg header
+	 * is allocated and freed by libemq */
+	inline Message message(const void *data, size_t size)
+	{
+		void *buffer;
+
+		if (!resource)
+		{
+			return Message((void*)data, size);
+		}
+
+		buffer = ((std::pmr::memory_resource*)resource)->allocate(size ? size : 1);
+		memcpy(buffer, data, size);
+
+		return Message(buffer, size, &deallocate, resource);
+	}
+#endif
+
+	inline bool set_options(const ConnectOptions &options)
+	{
+		struct sockaddr_storage addr;
+		socklen_t addr_size = sizeof(addr);
+		bool status = true;
+		int fd;
+
+		if (!client)
+		{
+			return false;
+		}
+
+		fd = client->fd;
+
+		if (getsockname(fd, (struct sockaddr*)&addr, &addr_size) == -1)
+		{
+			return false;
+		}
+
+		if (options.send_buffer)
+		{
+			status &= set_option(fd, SOL_SOCKET, SO_SNDBUF, options.send_buffer);
+		}
+
+		if (options.receive_buffer)
+		{
+			status &= set_option(fd, SOL_SOCKET, SO_RCVBUF, options.receive_buffer);
+		}
+
+		if (addr.ss_family != AF_INET && addr.ss_family != AF_INET6)
+		{
+			return status;
+		}
+
+		if (options.nodelay)
+		{
+			status &= set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+		}
+
+#ifdef SO_BUSY_POLL
+		if (options.busy_poll)
+		{
+			status &= set_option(fd, SOL_SOCKET, SO_BUSY_POLL, options.busy_poll);
+		}
+#endif
+
+		if (options.keepalive)
+		{
+			status &= set_option(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+
+#ifdef TCP_KEEPIDLE
+			if (options.keepalive_idle)
+			{
+				status &= set_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, options.keepalive_idle);
+			}
+
+			if (options.keepalive_interval)
+			{
+				status &= set_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, options.keepalive_interval);
+			}
+
+			if (options.keepalive_count)
+			{
+				status &= set_option(fd, IPPROTO_TCP, TCP_KEEPCNT, options.keepalive_count);
+			}
+#endif
+		}
+
+		return status;
+	}
+
+	inline void set_exist_cache(ExistCache *cache)
+	{
+		queue.set_cache(cache);
+		route.set_cache(cache);
+		channel.set_cache(cache);
+	}
+
+	inline void set_tracer(Tracer *tracer)
+	{
+		queue.set_tracer(tracer);
+		route.set_tracer(tracer);
+		channel.set_tracer(tracer);
+	}
+
+	inline void set_metrics(Metrics *metrics)
+	{
+		this->metrics = metrics;
+		user.set_metrics(metrics);
+		queue.set_metrics(metrics);
+		route.set_metrics(metrics);
+		channel.set_metrics(metrics);
+	}
+
+	inline void set_recorder(Recorder *recorder)
+	{
+		this->recorder = recorder;
+		queue.set_recorder(recorder);
+		route.set_recorder(recorder);
+		channel.set_recorder(recorder);
+	}
+
+	inline void set_integrity(Integrity *integrity)
+	{
+		queue.set_integrity(integrity);
+		route.set_integrity(integrity);
+		channel.set_integrity(integrity);
+	}
+
+private:
+	static bool set_option(int fd, int level, int name, int value)
+	{
+		return setsockopt(fd, level, name, &value, sizeof(value)) == 0;
+	}
+
+#if __cplusplus >= 201703L
+	static void deallocate(void *resource, void *data, size_t size)
+	{
+		((std::pmr::memory_resource*)resource)->deallocate(data, size ? size : 1);
+	}
+#endif
+
+	emq_client *open()
+	{
+		if (!path.empty())
+		{
+			return emq_unix_connect(path.c_str());
+		}
+
+		return probe(addr, port, options.connect_timeout) ? emq_tcp_connect(addr.c_str(), port) : NULL;
+	}
+
+	static bool probe(const std::string &addr, int port, Time timeout)
+	{
+		struct addrinfo hints, *list, *info;
+		char service[16];
+		bool status = false;
+
+		if (!timeout)
+		{
+			return true;
+		}
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		snprintf(service, sizeof(service), "%d", port);
+
+		if (getaddrinfo(addr.c_str(), service, &hints, &list) != 0)
+		{
+			return false;
+		}
+
+		for (info = list; info && !status; info = info->ai_next)
+		{
+			int fd = socket(info->ai_family, info->ai_socktype | SOCK_NONBLOCK, info->ai_protocol);
+			struct pollfd pfd;
+			int error = 0;
+			socklen_t size = sizeof(error);
+
+			if (fd == -1)
+			{
+				continue;
+			}
+
+			if (connect(fd, info->ai_addr, info->ai_addrlen) == 0)
+			{
+				status = true;
+			}
+			else if (errno == EINPROGRESS)
+			{
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				pfd.revents = 0;
+
+				status = ::poll(&pfd, 1, timeout) == 1 &&
+					getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &size) == 0 && error == 0;
+			}
+
+			::close(fd);
+		}
+
+		freeaddrinfo(list);
+
+		return status;
+	}
+
+	void init()
+	{
+		user.set_client(client);
+		queue.set_client(client);
+		route.set_client(client);
+		channel.set_client(client);
+		set_exist_cache(NULL);
+		set_tracer(NULL);
+		set_metrics(NULL);
+		set_recorder(NULL);
+		set_integrity(NULL);
+		resource = NULL;
+	}
+
+public:
+	UserControl user;
+	QueueControl queue;
+	RouteControl route;
+	ChannelControl channel;
+
+private:
+	Client(const Client&);
+	void operator=(const Client&);
+
+	template <typename T>
+	friend class Registry;
+
+private:
+	emq_client *client;
+	Metrics *metrics;
+	Recorder *recorder;
+	std::string addr;
+	int port;
+	std::string path;
+	ConnectOptions options;
+	/* a std::pmr::memory_resource under C++17, kept in every build so the layout does not depend on -std */
+	void *resource;
+};
+
+inline bool ExistCache::refresh(Client &client)
+{
+	std::vector<Queue> queues;
+	std::vector<Route> routes;
+	std::vector<Channel> channels;
+	std::vector<std::string> names;
+
+	if (!client.queue.list(queues) || !client.route.list(routes) || !client.channel.list(channels))
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < queues.size(); i++)
+	{
+		names.push_back(queues[i].name);
+	}
+
+	replace(QUEUE, names);
+	names.clear();
+
+	for (size_t i = 0; i < routes.size(); i++)
+	{
+		names.push_back(routes[i].name);
+	}
+
+	replace(ROUTE, names);
+	names.clear();
+
+	for (size_t i = 0; i < channels.size(); i++)
+	{
+		names.push_back(channels[i].name);
+	}
+
+	replace(CHANNEL, names);
+
+	return true;
+}
+
+class ExpireBuffer
+{
+private:
+	enum Target
+	{
+		TARGET_QUEUE,
+		TARGET_ROUTE,
+		TARGET_CHANNEL
+	};
+
+	struct Entry
+	{
+		Target target;
+		std::string name;
+		std::string key;
+		emq_msg *msg;
+		uint64_t deadline;
+		Entry *prev;
+		Entry *next;
+	};
+
+public:
+	ExpireBuffer(Time resolution = 10, size_t slots = 1024) :
+		resolution(resolution ? resolution : 1), wheel(slots ? slots : 1, NULL),
+		tick(monotonic_time() / this->resolution), dropped_count(0), sent_count(0), pending_count(0)
+	{
+	}
+
+	~ExpireBuffer()
+	{
+		clear();
+	}
+
+	inline void queue(const std::string &name, Message &message, Time ttl)
+	{
+		add(TARGET_QUEUE, name, std::string(), message, ttl);
+	}
+
+	inline void route(const std::string &name, const std::string &key, Message &message, Time ttl)
+	{
+		add(TARGET_ROUTE, name, key, message, ttl);
+	}
+
+	inline void publish(const std::string &name, const std::string &topic, Message &message, Time ttl)
+	{
+		add(TARGET_CHANNEL, name, topic, message, ttl);
+	}
+
+	inline size_t expire()
+	{
+		uint64_t now = monotonic_time();
+		uint64_t now_tick = now / resolution;
+		size_t dropped = 0;
+		uint64_t steps;
+
+		steps = now_tick - tick;
+		if (steps >= wheel.size())
+		{
+			steps = wheel.size() - 1;
+		}
+
+		for (uint64_t i = 0; i <= steps; i++)
+		{
+			Entry *entry = wheel[(now_tick - i) % wheel.size()];
+
+			while (entry)
+			{
+				Entry *next = entry->next;
+
+				if (entry->deadline <= now)
+				{
+					drop(entry);
+					dropped++;
+				}
+
+				entry = next;
+			}
+		}
+
+		tick = now_tick;
+
+		return dropped;
+	}
+
+	inline bool flush(Client &client, size_t max = 0)
+	{
+		size_t sent = 0;
+
+		expire();
+
+		while (!order.empty() && (!max || sent < max))
+		{
+			Entry *entry = order.front();
+			uint64_t now;
+			bool status;
+
+			if (!entry->msg)
+			{
+				order.pop_front();
+				delete entry;
+				continue;
+			}
+
+			now = monotonic_time();
+			if (entry->deadline <= now)
+			{
+				drop(entry);
+				continue;
+			}
+
+			Message message(entry->msg);
+
+			message.set_expire((Time)(entry->deadline - now));
+
+			switch (entry->target)
+			{
+				case TARGET_QUEUE:
+					status = client.queue.push(entry->name, message);
+					break;
+				case TARGET_ROUTE:
+					status = client.route.push(entry->name, entry->key, message);
+					break;
+				default:
+					status = client.channel.publish(entry->name, entry->key, message);
+					break;
+			}
+
+			message.release();
+
+			if (!status)
+			{
+				return false;
+			}
+
+			unlink(entry);
+			emq_msg_release(entry->msg);
+			order.pop_front();
+			delete entry;
+
+			pending_count--;
+			sent_count++;
+			sent++;
+		}
+
+		return true;
+	}
+
+	inline void clear()
+	{
+		while (!order.empty())
+		{
+			Entry *entry = order.front();
+
+			if (entry->msg)
+			{
+				unlink(entry);
+				emq_msg_release(entry->msg);
+			}
+
+			order.pop_front();
+			delete entry;
+		}
+
+		pending_count = 0;
+	}
+
+	inline size_t pending() const
+	{
+		return pending_count;
+	}
+
+	inline uint64_t dropped() const
+	{
+		return dropped_count;
+	}
+
+	inline uint64_t sent() const
+	{
+		return sent_count;
+	}
+
+private:
+	void add(Target target, const std::string &name, const std::string &key, Message &message, Time ttl)
+	{
+		Entry *entry = new Entry;
+		size_t slot;
+
+		entry->target = target;
+		entry->name = name;
+		entry->key = key;
+		entry->msg = message.release();
+		entry->deadline = monotonic_time() + ttl;
+		entry->prev = NULL;
+
+		slot = (entry->deadline / resolution) % wheel.size();
+		entry->next = wheel[slot];
+		if (entry->next)
+		{
+			entry->next->prev = entry;
+		}
+		wheel[slot] = entry;
+
+		order.push_back(entry);
+		pending_count++;
+	}
+
+	void unlink(Entry *entry)
+	{
+		if (entry->prev)
+		{
+			entry->prev->next = entry->next;
+		}
+		else
+		{
+			wheel[(entry->deadline / resolution) % wheel.size()] = entry->next;
+		}
+
+		if (entry->next)
+		{
+			entry->next->prev = entry->prev;
+		}
+
+		entry->prev = entry->next = NULL;
+	}
+
+	void drop(Entry *entry)
+	{
+		unlink(entry);
+		emq_msg_release(entry->msg);
+		entry->msg = NULL;
+
+		pending_count--;
+		dropped_count++;
+	}
+
+private:
+	ExpireBuffer(const ExpireBuffer&);
+	void operator=(const ExpireBuffer&);
+
+private:
+	Time resolution;
+	std::vector<Entry*> wheel;
+	std::deque<Entry*> order;
+	uint64_t tick;
+	uint64_t dropped_count;
+	uint64_t sent_count;
+	size_t pending_count;
+};
+
+class Spool
+{
+private:
+	enum Target
+	{
+		TARGET_QUEUE,
+		TARGET_ROUTE,
+		TARGET_CHANNEL
+	};
+
+	struct SegmentHeader
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint64_t read;
+		char reserved[48];
+	};
+
+	struct RecordHeader
+	{
+		uint32_t size;
+		uint32_t checksum;
+		uint8_t target;
+		uint8_t reserved;
+		uint16_t name_size;
+		uint16_t key_size;
+		uint16_t reserved2;
+		uint32_t data_size;
+		uint32_t reserved3;
+	};
+
+	struct Segment
+	{
+		uint64_t id;
+		int fd;
+		char *base;
+		size_t size;
+		size_t write;
+		SegmentHeader *header;
+	};
+
+	enum
+	{
+		SEGMENT_MAGIC = 0x51504d45,
+		SEGMENT_VERSION = 1,
+		RECORD_ALIGN = 8
+	};
+
+public:
+	Spool(Client &client, const std::string &path, size_t segment_size = 64 * 1024 * 1024,
+		size_t max_segments = 16, Time retry = 100, size_t max_attempts = 0) :
+		client(client), path(path), segment_size(segment_size), max_segments(max_segments ? max_segments : 1),
+		retry(retry), max_attempts(max_attempts), running(false), next_id(0), attempts(0), pending_count(0),
+		drained_count(0), dropped_count(0)
+	{
+	}
+
+	~Spool()
+	{
+		close();
+	}
+
+	bool open()
+	{
+		std::vector<uint64_t> ids;
+		DIR *dir;
+		struct dirent *entry;
+
+		if (running)
+		{
+			return true;
+		}
+
+		if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST)
+		{
+			return false;
+		}
+
+		dir = opendir(path.c_str());
+		if (!dir)
+		{
+			return false;
+		}
+
+		while ((entry = readdir(dir)) != NULL)
+		{
+			unsigned long long id;
+			char suffix;
+
+			if (sscanf(entry->d_name, "%llu.spoo%c", &id, &suffix) == 2 && suffix == 'l')
+			{
+				ids.push_back(id);
+			}
+		}
+
+		closedir(dir);
+
+		std::sort(ids.begin(), ids.end());
+
+		next_id = ids.empty() ? 0 : ids.back() + 1;
+
+		for (size_t i = 0; i < ids.size(); i++)
+		{
+			Segment *segment = map_segment(ids[i], false);
+
+			if (!segment)
+			{
+				continue;
+			}
+
+			recover(segment);
+			segments.push_back(segment);
+		}
+
+		if (segments.empty() && !add_segment())
+		{
+			return false;
+		}
+
+		running = true;
+		thread = std::thread(&Spool::drain, this);
+
+		return true;
+	}
+
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (!running)
+			{
+				return;
+			}
+
+			running = false;
+		}
+
+		cond.notify_all();
+		thread.join();
+
+		while (!segments.empty())
+		{
+			unmap_segment(segments.front(), false);
+			segments.pop_front();
+		}
+	}
+
+	inline bool queue(const std::string &name, Message &message)
+	{
+		return append(TARGET_QUEUE, name, std::string(), message);
+	}
+
+	inline bool route(const std::string &name, const std::string &key, Message &message)
+	{
+		return append(TARGET_ROUTE, name, key, message);
+	}
+
+	inline bool publish(const std::string &name, const std::string &topic, Message &message)
+	{
+		return append(TARGET_CHANNEL, name, topic, message);
+	}
+
+	inline bool sync()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		for (size_t i = 0; i < segments.size(); i++)
+		{
+			if (msync(segments[i]->base, segments[i]->size, MS_SYNC) == -1)
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	inline size_t pending()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return pending_count;
+	}
+
+	inline uint64_t drained()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return drained_count;
+	}
+
+	inline uint64_t dropped()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return dropped_count;
+	}
+
+	inline void set_dead_letter(const std::string &queue)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		dead_letter = queue;
+	}
+
+	inline std::mutex &client_lock()
+	{
+		return client_mutex;
+	}
+
+private:
+	static size_t align(size_t size)
+	{
+		return (size + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1);
+	}
+
+	static uint32_t record_checksum(const RecordHeader *record)
+	{
+		const char *body = (const char*)record + offsetof(RecordHeader, target);
+
+		return checksum(body, sizeof(RecordHeader) - offsetof(RecordHeader, target) +
+			record->name_size + record->key_size + record->data_size);
+	}
+
+	std::string segment_path(uint64_t id)
+	{
+		char name[32];
+
+		snprintf(name, sizeof(name), "%016llu.spool", (unsigned long long)id);
+
+		return path + "/" + name;
+	}
+
+	Segment *map_segment(uint64_t id, bool create)
+	{
+		std::string file = segment_path(id);
+		Segment *segment;
+		struct stat st;
+		void *base;
+		int fd;
+
+		fd = ::open(file.c_str(), create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0644);
+		if (fd == -1)
+		{
+			return NULL;
+		}
+
+		if (create && posix_fallocate(fd, 0, segment_size) != 0)
+		{
+			::close(fd);
+			unlink(file.c_str());
+			return NULL;
+		}
+
+		if (fstat(fd, &st) == -1 || (size_t)st.st_size <= sizeof(SegmentHeader))
+		{
+			::close(fd);
+			return NULL;
+		}
+
+		base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED)
+		{
+			::close(fd);
+			return NULL;
+		}
+
+		segment = new Segment;
+		segment->id = id;
+		segment->fd = fd;
+		segment->base = (char*)base;
+		segment->size = st.st_size;
+		segment->write = sizeof(SegmentHeader);
+		segment->header = (SegmentHeader*)base;
+
+		if (create)
+		{
+			segment->header->magic = SEGMENT_MAGIC;
+			segment->header->version = SEGMENT_VERSION;
+			segment->header->read = sizeof(SegmentHeader);
+		}
+		else if (segment->header->magic != SEGMENT_MAGIC || segment->header->version != SEGMENT_VERSION)
+		{
+			unmap_segment(segment, false);
+			return NULL;
+		}
+
+		return segment;
+	}
+
+	void unmap_segment(Segment *segment, bool remove)
+	{
+		munmap(segment->base, segment->size);
+		::close(segment->fd);
+
+		if (remove)
+		{
+			unlink(segment_path(segment->id).c_str());
+		}
+
+		delete segment;
+	}
+
+	void recover(Segment *segment)
+	{
+		size_t offset = sizeof(SegmentHeader);
+
+		while (offset + sizeof(RecordHeader) <= segment->size)
+		{
+			RecordHeader *record = (RecordHeader*)(segment->base + offset);
+
+			if (record->size < sizeof(RecordHeader) || record->size > segment->size - offset ||
+				record->size != align(sizeof(RecordHeader) + record->name_size +
+					record->key_size + record->data_size) ||
+				record->checksum != record_checksum(record))
+			{
+				break;
+			}
+
+			if (offset >= segment->header->read)
+			{
+				pending_count++;
+			}
+
+			offset += record->size;
+		}
+
+		segment->write = offset;
+
+		if (segment->header->read < sizeof(SegmentHeader) || segment->header->read > offset)
+		{
+			segment->header->read = offset;
+		}
+
+		memset(segment->base + offset, 0, std::min(segment->size - offset, sizeof(RecordHeader)));
+	}
+
+	bool add_segment()
+	{
+		Segment *segment;
+
+		if (segments.size() >= max_segments)
+		{
+			return false;
+		}
+
+		segment = map_segment(next_id, true);
+		if (!segment)
+		{
+			return false;
+		}
+
+		next_id++;
+		segments.push_back(segment);
+
+		return true;
+	}
+
+	bool append(Target target, const std::string &name, const std::string &key, Message &message)
+	{
+		size_t data_size = message.size();
+		size_t size = align(sizeof(RecordHeader) + name.size() + key.size() + data_size);
+		RecordHeader *record;
+		Segment *segment;
+		char *ptr;
+
+		if (name.size() > UINT16_MAX || key.size() > UINT16_MAX || data_size > UINT32_MAX ||
+			size > segment_size - sizeof(SegmentHeader))
+		{
+			return false;
+		}
+
+		std::unique_lock<std::mutex> lock(mutex);
+
+		if (!running)
+		{
+			return false;
+		}
+
+		segment = segments.back();
+		if (segment->write + size > segment->size)
+		{
+			if (!add_segment())
+			{
+				return false;
+			}
+
+			segment = segments.back();
+		}
+
+		record = (RecordHeader*)(segment->base + segment->write);
+		record->target = target;
+		record->reserved = 0;
+		record->name_size = name.size();
+		record->key_size = key.size();
+		record->reserved2 = 0;
+		record->data_size = data_size;
+		record->reserved3 = 0;
+
+		ptr = (char*)(record + 1);
+		memcpy(ptr, name.data(), name.size());
+		ptr += name.size();
+		memcpy(ptr, key.data(), key.size());
+		ptr += key.size();
+		memcpy(ptr, message.data(), data_size);
+
+		record->checksum = record_checksum(record);
+		record->size = size;
+
+		segment->write += size;
+		if (segment->write + sizeof(RecordHeader) <= segment->size)
+		{
+			memset(segment->base + segment->write, 0, sizeof(RecordHeader));
+		}
+
+		pending_count++;
+
+		lock.unlock();
+		cond.notify_one();
+
+		return true;
+	}
+
+	bool send(const RecordHeader *record, const std::string &dead_letter = std::string())
+	{
+		const char *ptr = (const char*)(record + 1);
+		std::string name(ptr, record->name_size);
+		std::string key(ptr + record->name_size, record->key_size);
+		Message message((void*)(ptr + record->name_size + record->key_size), record->data_size, true);
+
+		std::lock_guard<std::mutex> lock(client_mutex);
+
+		if (!message.msg())
+		{
+			return false;
+		}
+
+		if (!dead_letter.empty())
+		{
+			return client.queue.push(dead_letter, message);
+		}
+
+		switch (record->target)
+		{
+			case TARGET_QUEUE:
+				return client.queue.push(name, message);
+			case TARGET_ROUTE:
+				return client.route.push(name, key, message);
+			case TARGET_CHANNEL:
+				return client.channel.publish(name, key, message);
+		}
+
+		return true;
+	}
+
+	/* a lost connection or a full queue clears up on its own, so such failures never count as attempts */
+	bool transient(const RecordHeader *record)
+	{
+		std::string name((const char*)(record + 1), record->name_size);
+		std::vector<Queue> queues;
+
+		std::lock_guard<std::mutex> lock(client_mutex);
+
+		if (!client.connected() || !client.ping())
+		{
+			return true;
+		}
+
+		if (record->target != TARGET_QUEUE)
+		{
+			return false;
+		}
+
+		if (!client.queue.list(queues))
+		{
+			return true;
+		}
+
+		for (size_t i = 0; i < queues.size(); i++)
+		{
+			if (name == queues[i].name)
+			{
+				return queues[i].max_msg && queues[i].size >= queues[i].max_msg;
+			}
+		}
+
+		return false;
+	}
+
+	void drain()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+
+		while (running)
+		{
+			Segment *segment = segments.front();
+			size_t read = segment->header->read;
+
+			if (read < segment->write)
+			{
+				const RecordHeader *record = (const RecordHeader*)(segment->base + read);
+
+				lock.unlock();
+
+				if (!send(record))
+				{
+					bool retry_only = !max_attempts || transient(record);
+
+					lock.lock();
+
+					if (!retry_only && ++attempts >= max_attempts)
+					{
+						std::string queue = dead_letter;
+
+						lock.unlock();
+						if (!queue.empty())
+						{
+							send(record, queue);
+						}
+						lock.lock();
+
+						segment->header->read = read + record->size;
+						pending_count--;
+						dropped_count++;
+						attempts = 0;
+						continue;
+					}
+
+					/* appends notify the same condition, so wait out the whole back-off */
+					cond.wait_for(lock, std::chrono::milliseconds(retry), [this] { return !running; });
+					continue;
+				}
+
+				lock.lock();
+
+				segment->header->read = read + record->size;
+				pending_count--;
+				drained_count++;
+				attempts = 0;
+			}
+			else if (segments.size() > 1)
+			{
+				segments.pop_front();
+				unmap_segment(segment, true);
+			}
+			else
+			{
+				cond.wait(lock);
+			}
+		}
+	}
+
+private:
+	Spool(const Spool&);
+	void operator=(const Spool&);
+
+private:
+	Client &client;
+	std::string path;
+	size_t segment_size;
+	size_t max_segments;
+	Time retry;
+	size_t max_attempts;
+	bool running;
+	uint64_t next_id;
+	size_t attempts;
+	std::string dead_letter;
+	std::deque<Segment*> segments;
+	std::thread thread;
+	std::mutex mutex;
+	std::mutex client_mutex;
+	std::condition_variable cond;
+	size_t pending_count;
+	uint64_t drained_count;
+	uint64_t dropped_count;
+};
+
+class FlowControl
+{
+private:
+	struct State
+	{
+		double depth;
+		double pushed;
+		double rate;
+		double sample_time;
+		double next;
+		double sampling;
+		bool stale;
+	};
+
+	struct Entry
+	{
+		char name[64];
+		State state;
+	};
+
+	enum
+	{
+		REGION_MAGIC = 0x4c464d45,
+		REGION_ENTRIES = 256
+	};
+
+	struct Region
+	{
+		std::atomic<uint32_t> magic;
+		uint32_t count;
+		pthread_mutex_t mutex;
+		Entry entries[REGION_ENTRIES];
+	};
+
+	class Lock
+	{
+	public:
+		Lock(pthread_mutex_t *mutex) : mutex(mutex)
+		{
+		}
+
+		void lock()
+		{
+			if (pthread_mutex_lock(mutex) == EOWNERDEAD)
+			{
+				pthread_mutex_consistent(mutex);
+			}
+		}
+
+		void unlock()
+		{
+			pthread_mutex_unlock(mutex);
+		}
+
+	private:
+		pthread_mutex_t *mutex;
+	};
+
+public:
+	FlowControl(uint32_t target, Time interval = 100, Time max_delay = 1000, const std::string &path = std::string()) :
+		target(target ? target : 1), interval(interval ? interval : 1), max_delay(max_delay), region(NULL),
+		shared(false), delayed_time(0), rejected_count(0)
+	{
+		if (!path.empty())
+		{
+			region = map_region(path);
+			shared = region != NULL;
+		}
+
+		if (!region)
+		{
+			region = new Region;
+			init_region(region, false);
+		}
+	}
+
+	~FlowControl()
+	{
+		if (shared)
+		{
+			munmap(region, sizeof(Region));
+		}
+		else
+		{
+			pthread_mutex_destroy(&region->mutex);
+			delete region;
+		}
+	}
+
+	inline bool acquire(Client &client, const std::string &name)
+	{
+		Lock mutex(&region->mutex);
+		std::unique_lock<Lock> lock(mutex);
+		State *state = find(name);
+		double start = now();
+		double delay;
+
+		if (!state)
+		{
+			return true;
+		}
+
+		while (true)
+		{
+			double current = now();
+			double depth;
+
+			if ((state->stale || current - state->sample_time >= interval) &&
+				(!state->sampling || current - state->sampling > std::max<double>(interval * 10, 1000)))
+			{
+				double pushed = state->pushed;
+				int size;
+				bool status;
+
+				state->sampling = current;
+				lock.unlock();
+				status = client.queue.size(name, &size);
+				lock.lock();
+				state->sampling = 0;
+
+				current = now();
+				if (status)
+				{
+					sample(state, size, pushed, current);
+				}
+			}
+
+			depth = state->depth + state->pushed - state->rate * (current - state->sample_time);
+			if (depth < 0)
+			{
+				depth = 0;
+			}
+
+			if (depth + 1 <= target)
+			{
+				double spacing = 1 / (state->rate + (target - depth) / interval);
+
+				if (current >= state->next)
+				{
+					state->next = std::max(state->next, current - interval) + spacing;
+					state->pushed++;
+					delayed_time += current - start;
+					return true;
+				}
+
+				delay = state->next - current;
+			}
+			else
+			{
+				delay = state->rate > 0 ? (depth + 1 - target) / state->rate : interval;
+			}
+
+			delay = std::min(delay, (double)interval);
+
+			if (max_delay && current + delay - start > max_delay)
+			{
+				delayed_time += current - start;
+				return false;
+			}
+
+			lock.unlock();
+			std::this_thread::sleep_for(std::chrono::microseconds((int64_t)(delay * 1000) + 1));
+			lock.lock();
+		}
+	}
+
+	inline bool push(Client &client, const std::string &name, Message &message)
+	{
+		if (!acquire(client, name))
+		{
+			return false;
+		}
+
+		if (!client.queue.push(name, message))
+		{
+			Lock mutex(&region->mutex);
+			std::lock_guard<Lock> lock(mutex);
+			State *state = find(name);
+
+			if (state)
+			{
+				state->pushed = std::max(state->pushed - 1, 0.0);
+				state->stale = true;
+			}
+
+			rejected_count++;
+
+			return false;
+		}
+
+		return true;
+	}
+
+	inline double drain_rate(const std::string &name)
+	{
+		Lock mutex(&region->mutex);
+		std::lock_guard<Lock> lock(mutex);
+		State *state = find(name);
+
+		return state ? state->rate * 1000 : 0;
+	}
+
+	inline double delayed()
+	{
+		Lock mutex(&region->mutex);
+		std::lock_guard<Lock> lock(mutex);
+
+		return delayed_time;
+	}
+
+	inline uint64_t rejected()
+	{
+		Lock mutex(&region->mutex);
+		std::lock_guard<Lock> lock(mutex);
+
+		return rejected_count;
+	}
+
+	inline bool is_shared()
+	{
+		return shared;
+	}
+
+private:
+	static double now()
+	{
+		return std::chrono::duration_cast<std::chrono::duration<double, std::milli> >(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static bool init_region(Region *region, bool shared)
+	{
+		pthread_mutexattr_t attr;
+		bool status;
+
+		region->count = 0;
+		memset(region->entries, 0, sizeof(region->entries));
+
+		pthread_mutexattr_init(&attr);
+		if (shared)
+		{
+			pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+			pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+		}
+		status = pthread_mutex_init(&region->mutex, &attr) == 0;
+		pthread_mutexattr_destroy(&attr);
+
+		region->magic.store(REGION_MAGIC, std::memory_order_release);
+
+		return status;
+	}
+
+	static Region *map_region(const std::string &path)
+	{
+		Region *region;
+		bool create = true;
+		struct stat st;
+		void *base;
+		int fd;
+
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd == -1 && errno == EEXIST)
+		{
+			create = false;
+			fd = ::open(path.c_str(), O_RDWR);
+		}
+
+		if (fd == -1)
+		{
+			return NULL;
+		}
+
+		if (create && ftruncate(fd, sizeof(Region)) == -1)
+		{
+			::close(fd);
+			unlink(path.c_str());
+			return NULL;
+		}
+
+		for (int i = 0; !create && i < 100; i++)
+		{
+			if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Region))
+			{
+				break;
+			}
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Region))
+		{
+			::close(fd);
+			return NULL;
+		}
+
+		base = mmap(NULL, sizeof(Region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+
+		if (base == MAP_FAILED)
+		{
+			return NULL;
+		}
+
+		region = (Region*)base;
+
+		if (create)
+		{
+			init_region(region, true);
+			return region;
+		}
+
+		for (int i = 0; i < 100 && region->magic.load(std::memory_order_acquire) != REGION_MAGIC; i++)
+		{
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		if (region->magic.load(std::memory_order_acquire) != REGION_MAGIC)
+		{
+			munmap(base, sizeof(Region));
+			return NULL;
+		}
+
+		return region;
+	}
+
+	State *find(const std::string &name)
+	{
+		Entry *entry;
+
+		if (name.size() >= sizeof(entry->name))
+		{
+			return NULL;
+		}
+
+		for (uint32_t i = 0; i < region->count; i++)
+		{
+			if (name == region->entries[i].name)
+			{
+				return &region->entries[i].state;
+			}
+		}
+
+		if (region->count >= REGION_ENTRIES)
+		{
+			return NULL;
+		}
+
+		entry = &region->entries[region->count++];
+		memcpy(entry->name, name.c_str(), name.size() + 1);
+		memset(&entry->state, 0, sizeof(entry->state));
+
+		return &entry->state;
+	}
+
+	void sample(State *state, int size, double pushed, double current)
+	{
+		if (state->sample_time > 0 && current > state->sample_time)
+		{
+			double consumed = state->depth + pushed - size;
+			double rate = std::max(consumed, 0.0) / (current - state->sample_time);
+
+			state->rate = state->rate > 0 ? 0.7 * state->rate + 0.3 * rate : rate;
+		}
+
+		state->depth = size;
+		state->pushed = std::max(state->pushed - pushed, 0.0);
+		state->sample_time = current;
+		state->stale = false;
+	}
+
+private:
+	FlowControl(const FlowControl&);
+	void operator=(const FlowControl&);
+
+private:
+	double target;
+	Time interval;
+	Time max_delay;
+	Region *region;
+	bool shared;
+	double delayed_time;
+	uint64_t rejected_count;
+};
+
+class MultiQueueConsumer
+{
+private:
+	struct Source
+	{
+		std::string name;
+		uint32_t weight;
+		uint32_t priority;
+		int64_t current;
+		bool backoff;
+		Time idle;
+		uint64_t idle_until;
+		uint64_t received;
+		uint64_t empty;
+	};
+
+public:
+	typedef std::function<bool(const std::string&, Message&)> Handler;
+
+	MultiQueueConsumer(Time timeout = 0, Time min_idle = 10, Time max_idle = 1000) :
+		timeout(timeout), min_idle(min_idle ? min_idle : 1), max_idle(std::max(max_idle, min_idle))
+	{
+	}
+
+	inline void add(const std::string &name, uint32_t weight = 1, uint32_t priority = 0, bool backoff = true)
+	{
+		Source source;
+
+		remove(name);
+
+		source.name = name;
+		source.weight = weight ? weight : 1;
+		source.priority = priority;
+		source.current = 0;
+		source.backoff = backoff;
+		source.idle = 0;
+		source.idle_until = 0;
+		source.received = 0;
+		source.empty = 0;
+
+		sources.push_back(source);
+	}
+
+	inline void remove(const std::string &name)
+	{
+		for (size_t i = 0; i < sources.size(); i++)
+		{
+			if (sources[i].name == name)
+			{
+				sources.erase(sources.begin() + i);
+				return;
+			}
+		}
+	}
+
+	inline size_t poll(Client &client, Handler handler, size_t max = 0)
+	{
+		std::vector<bool> tried(sources.size(), false);
+		size_t count = 0;
+
+		while (!max || count < max)
+		{
+			uint64_t now = monotonic_time();
+			Source *source = select(tried, now);
+
+			if (!source)
+			{
+				break;
+			}
+
+			Message message = client.queue.pop(source->name, timeout);
+
+			if (!message.msg())
+			{
+				if (source->backoff)
+				{
+					source->idle = source->idle ? std::min<Time>(source->idle * 2, max_idle) : min_idle;
+					source->idle_until = now + source->idle;
+				}
+
+				source->empty++;
+				tried[source - &sources[0]] = true;
+				continue;
+			}
+
+			source->idle = 0;
+			source->idle_until = 0;
+			source->received++;
+			count++;
+
+			/* higher priorities found empty earlier in this pass get another look before the next message;
+			 * those backing off stay parked until idle_until */
+			for (size_t i = 0; i < sources.size(); i++)
+			{
+				if (sources[i].priority > source->priority)
+				{
+					tried[i] = false;
+				}
+			}
+
+			if (handler(source->name, message) && timeout)
+			{
+				client.queue.confirm(source->name, message.tag());
+			}
+		}
+
+		return count;
+	}
+
+	inline Time idle_time() const
+	{
+		uint64_t now = monotonic_time();
+		uint64_t wakeup = UINT64_MAX;
+
+		/* sources without backoff are never parked, so the caller should not sleep past min_idle */
+		for (size_t i = 0; i < sources.size(); i++)
+		{
+			wakeup = std::min(wakeup, sources[i].backoff ? sources[i].idle_until : now + min_idle);
+		}
+
+		if (wakeup == UINT64_MAX || wakeup <= now)
+		{
+			return 0;
+		}
+
+		return (Time)(wakeup - now);
+	}
+
+	inline bool stats(const std::string &name, uint64_t *received, uint64_t *empty) const
+	{
+		for (size_t i = 0; i < sources.size(); i++)
+		{
+			if (sources[i].name == name)
+			{
+				*received = sources[i].received;
+				*empty = sources[i].empty;
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+private:
+	Source *select(const std::vector<bool> &tried, uint64_t now)
+	{
+		Source *best = NULL;
+		int64_t total = 0;
+
+		for (size_t i = 0; i < sources.size(); i++)
+		{
+			Source &source = sources[i];
+
+			if (tried[i] || source.idle_until > now)
+			{
+				continue;
+			}
+
+			if (best && source.priority < best->priority)
+			{
+				continue;
+			}
+
+			if (best && source.priority > best->priority)
+			{
+				best = NULL;
+				total = 0;
+			}
+
+			total += source.weight;
+			if (!best || source.current + source.weight > best->current + best->weight)
+			{
+				best = &source;
+			}
+		}
+
+		if (!best)
+		{
+			return NULL;
+		}
+
+		for (size_t i = 0; i < sources.size(); i++)
+		{
+			Source &source = sources[i];
+
+			if (!tried[i] && source.idle_until <= now && source.priority == best->priority)
+			{
+				source.current += source.weight;
+			}
+		}
+
+		best->current -= total;
+
+		return best;
+	}
+
+private:
+	Time timeout;
+	Time min_idle;
+	Time max_idle;
+	std::vector<Source> sources;
+};
+
+class Topology
+{
+private:
+	struct QueueSpec
+	{
+		std::string name;
+		uint32_t max_msg;
+		uint32_t max_msg_size;
+		uint32_t flags;
+		bool declare;
+	};
+
+	struct RouteSpec
+	{
+		std::string name;
+		uint32_t flags;
+	};
+
+	struct BindingSpec
+	{
+		std::string route;
+		std::string queue;
+		std::string key;
+	};
+
+	struct ChannelSpec
+	{
+		std::string name;
+		uint32_t flags;
+	};
+
+	typedef std::function<bool(Client&)> Operation;
+
+public:
+	struct Report
+	{
+		size_t queues;
+		size_t routes;
+		size_t channels;
+		size_t bindings;
+		size_t declared;
+		size_t failed;
+	};
+
+	inline void queue(const std::string &name, uint32_t max_msg, uint32_t max_msg_size, uint32_t flags,
+		bool declare = false)
+	{
+		QueueSpec spec = { name, max_msg, max_msg_size, flags, declare };
+
+		queues.push_back(spec);
+	}
+
+	inline void route(const std::string &name, uint32_t flags)
+	{
+		RouteSpec spec = { name, flags };
+
+		routes.push_back(spec);
+	}
+
+	inline void bind(const std::string &route, const std::string &queue, const std::string &key)
+	{
+		BindingSpec spec = { route, queue, key };
+
+		bindings.push_back(spec);
+	}
+
+	inline void channel(const std::string &name, uint32_t flags)
+	{
+		ChannelSpec spec = { name, flags };
+
+		channels.push_back(spec);
+	}
+
+	inline bool apply(Client &client, Report *report = NULL)
+	{
+		std::vector<Client*> clients(1, &client);
+
+		return apply(clients, report);
+	}
+
+	inline bool apply(const std::vector<Client*> &clients, Report *report = NULL)
+	{
+		std::set<std::string> existing_queues, existing_routes, existing_channels;
+		std::set<std::string> existing_bindings, created_routes, fetched_routes;
+		std::vector<Operation> create_ops, bind_ops, declare_ops;
+		std::vector<Queue> queue_list;
+		std::vector<Route> route_list;
+		std::vector<Channel> channel_list;
+		Report result = Report();
+
+		if (clients.empty())
+		{
+			return false;
+		}
+
+		Client &client = *clients[0];
+
+		if (!queues.empty() && !client.queue.list(queue_list))
+		{
+			return false;
+		}
+
+		if ((!routes.empty() || !bindings.empty()) && !client.route.list(route_list))
+		{
+			return false;
+		}
+
+		if (!channels.empty() && !client.channel.list(channel_list))
+		{
+			return false;
+		}
+
+		for (size_t i = 0; i < queue_list.size(); i++)
+		{
+			existing_queues.insert(queue_list[i].name);
+		}
+
+		for (size_t i = 0; i < route_list.size(); i++)
+		{
+			existing_routes.insert(route_list[i].name);
+		}
+
+		for (size_t i = 0; i < channel_list.size(); i++)
+		{
+			existing_channels.insert(channel_list[i].name);
+		}
+
+		for (size_t i = 0; i < queues.size(); i++)
+		{
+			const QueueSpec &spec = queues[i];
+
+			if (existing_queues.insert(spec.name).second)
+			{
+				create_ops.push_back(std::bind(&Topology::create_queue, std::placeholders::_1, spec));
+				result.queues++;
+			}
+
+			if (spec.declare)
+			{
+				declare_ops.push_back(std::bind(&Topology::declare_queue, std::placeholders::_1, spec.name));
+				result.declared++;
+			}
+		}
+
+		for (size_t i = 0; i < routes.size(); i++)
+		{
+			const RouteSpec &spec = routes[i];
+
+			if (existing_routes.insert(spec.name).second)
+			{
+				create_ops.push_back(std::bind(&Topology::create_route, std::placeholders::_1, spec));
+				created_routes.insert(spec.name);
+				result.routes++;
+			}
+		}
+
+		for (size_t i = 0; i < channels.size(); i++)
+		{
+			const ChannelSpec &spec = channels[i];
+
+			if (existing_channels.insert(spec.name).second)
+			{
+				create_ops.push_back(std::bind(&Topology::create_channel, std::placeholders::_1, spec));
+				result.channels++;
+			}
+		}
+
+		for (size_t i = 0; i < bindings.size(); i++)
+		{
+			const BindingSpec &spec = bindings[i];
+
+			if (existing_routes.count(spec.route) && !created_routes.count(spec.route) &&
+				fetched_routes.insert(spec.route).second)
+			{
+				std::vector<RouteKey> keys;
+
+				if (!client.route.keys(spec.route, keys))
+				{
+					return false;
+				}
+
+				for (size_t j = 0; j < keys.size(); j++)
+				{
+					existing_bindings.insert(binding_id(spec.route, keys[j].queue, keys[j].key));
+				}
+			}
+
+			if (existing_bindings.insert(binding_id(spec.route, spec.queue, spec.key)).second)
+			{
+				bind_ops.push_back(std::bind(&Topology::bind_route, std::placeholders::_1, spec));
+				result.bindings++;
+			}
+		}
+
+		result.failed += execute(clients, create_ops);
+		result.failed += execute(clients, bind_ops);
+		result.failed += execute(std::vector<Client*>(1, &client), declare_ops);
+
+		if (report)
+		{
+			*report = result;
+		}
+
+		return result.failed == 0;
+	}
+
+	inline void clear()
+	{
+		queues.clear();
+		routes.clear();
+		bindings.clear();
+		channels.clear();
+	}
+
+private:
+	static std::string binding_id(const std::string &route, const std::string &queue, const std::string &key)
+	{
+		return route + '\0' + queue + '\0' + key;
+	}
+
+	static bool create_queue(Client &client, const QueueSpec &spec)
+	{
+		return client.queue.create(spec.name, spec.max_msg, spec.max_msg_size, spec.flags);
+	}
+
+	static bool declare_queue(Client &client, const std::string &name)
+	{
+		return client.queue.declare(name);
+	}
+
+	static bool create_route(Client &client, const RouteSpec &spec)
+	{
+		return client.route.create(spec.name, spec.flags);
+	}
+
+	static bool bind_route(Client &client, const BindingSpec &spec)
+	{
+		return client.route.bind(spec.route, spec.queue, spec.key);
+	}
+
+	static bool create_channel(Client &client, const ChannelSpec &spec)
+	{
+		return client.channel.create(spec.name, spec.flags);
+	}
+
+	static size_t execute(const std::vector<Client*> &clients, const std::vector<Operation> &ops)
+	{
+		std::vector<std::thread> threads;
+		std::atomic<size_t> next(0), failed(0);
+		size_t workers = std::min(clients.size(), ops.size());
+
+		for (size_t i = 0; i < workers; i++)
+		{
+			Client *client = clients[i];
+
+			threads.push_back(std::thread([&ops, &next, &failed, client]()
+			{
+				size_t index;
+
+				while ((index = next++) < ops.size())
+				{
+					if (!ops[index](*client))
+					{
+						failed++;
+					}
+				}
+			}));
+		}
+
+		for (size_t i = 0; i < threads.size(); i++)
+		{
+			threads[i].join();
+		}
+
+		return failed;
+	}
+
+private:
+	std::vector<QueueSpec> queues;
+	std::vector<RouteSpec> routes;
+	std::vector<BindingSpec> bindings;
+	std::vector<ChannelSpec> channels;
+};
+
+class ConcurrentClient
+{
+private:
+	struct Node
+	{
+		std::atomic<Node*> next;
+		std::function<void(Client&)> task;
+	};
+
+public:
+	ConcurrentClient(Client &client) :
+		client(client), head(new Node), tail(head.load()), running(true), sleeping(false)
+	{
+		tail->next = NULL;
+		thread = std::thread(&ConcurrentClient::run, this);
+	}
+
+	~ConcurrentClient()
+	{
+		submit([this](Client&)
+		{
+			running = false;
+		});
+
+		thread.join();
+
+		delete tail;
+	}
+
+	template <typename Function>
+	std::future<decltype(std::declval<Function>()(std::declval<Client&>()))> submit(Function function)
+	{
+		typedef decltype(function(std::declval<Client&>())) Result;
+		std::shared_ptr<std::packaged_task<Result(Client&)> > task =
+			std::make_shared<std::packaged_task<Result(Client&)> >(function);
+		std::future<Result> future = task->get_future();
+		Node *node = new Node;
+
+		node->next = NULL;
+		node->task = [task](Client &client)
+		{
+			(*task)(client);
+		};
+
+		head.exchange(node, std::memory_order_seq_cst)->next.store(node, std::memory_order_seq_cst);
+
+		if (sleeping.load(std::memory_order_seq_cst))
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			cond.notify_one();
+		}
+
+		return future;
+	}
+
+	inline bool push(const std::string &name, Message &message)
+	{
+		return submit([&name, &message](Client &client)
+		{
+			return client.queue.push(name, message);
+		}).get();
+	}
+
+	inline bool route(const std::string &name, const std::string &key, Message &message)
+	{
+		return submit([&name, &key, &message](Client &client)
+		{
+			return client.route.push(name, key, message);
+		}).get();
+	}
+
+	inline bool publish(const std::string &name, const std::string &topic, Message &message)
+	{
+		return submit([&name, &topic, &message](Client &client)
+		{
+			return client.channel.publish(name, topic, message);
+		}).get();
+	}
+
+	inline Message get(const std::string &name)
+	{
+		Detached result = submit([&name](Client &client)
+		{
+			Message message = client.queue.get(name);
+
+			return detach(message);
+		}).get();
+
+		return Message(std::get<0>(result), std::get<1>(result), std::get<2>(result));
+	}
+
+	inline Message pop(const std::string &name, Time timeout)
+	{
+		Detached result = submit([&name, timeout](Client &client)
+		{
+			Message message = client.queue.pop(name, timeout);
+
+			return detach(message);
+		}).get();
+
+		return Message(std::get<0>(result), std::get<1>(result), std::get<2>(result));
+	}
+
+	inline bool confirm(const std::string &name, Tag tag)
+	{
+		return submit([&name, tag](Client &client)
+		{
+			return client.queue.confirm(name, tag);
+		}).get();
+	}
+
+private:
+	typedef std::tuple<emq_msg*, size_t, size_t> Detached;
+
+	/* keeps the head and tail stripped by tracer and integrity hooks across the future */
+	static Detached detach(Message &message)
+	{
+		size_t head;
+		size_t tail;
+
+		if (!message.msg())
+		{
+			return Detached(NULL, 0, 0);
+		}
+
+		head = (char*)message.data() - (char*)emq_msg_data(message.msg());
+		tail = emq_msg_size(message.msg()) - head - message.size();
+
+		return Detached(message.release(), head, tail);
+	}
+
+	Node *next()
+	{
+		Node *node = tail->next.load(std::memory_order_acquire);
+
+		if (node)
+		{
+			delete tail;
+			tail = node;
+		}
+
+		return node;
+	}
+
+	void run()
+	{
+		while (running)
+		{
+			Node *node = next();
+
+			if (!node)
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+
+				sleeping.store(true, std::memory_order_seq_cst);
+				if (!tail->next.load(std::memory_order_seq_cst))
+				{
+					cond.wait_for(lock, std::chrono::milliseconds(100));
+				}
+				sleeping.store(false, std::memory_order_relaxed);
+
+				continue;
+			}
+
+			node->task(client);
+			node->task = nullptr;
+		}
+	}
+
+private:
+	ConcurrentClient(const ConcurrentClient&);
+	void operator=(const ConcurrentClient&);
+
+private:
+	Client &client;
+	std::atomic<Node*> head;
+	Node *tail;
+	bool running;
+	std::atomic<bool> sleeping;
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond;
+};
+
+class Deduplicator
+{
+public:
+	Deduplicator(Time window, size_t bits = 1 << 20, size_t generations = 4, size_t hashes = 4) :
+		generation_time(std::max<Time>(window / std::max<size_t>(generations, 2), 1)),
+		mask(round_words(bits) - 1), hashes(std::min<size_t>(std::max<size_t>(hashes, 1), 8)),
+		filters(std::max<size_t>(generations, 2) + 1, std::vector<uint64_t>(round_words(bits), 0)),
+		current(0), cleared(round_words(bits)), rotate_at(coarse_time() + generation_time), checked_count(0),
+		duplicate_count(0)
+	{
+	}
+
+	inline bool duplicate(uint64_t id)
+	{
+		uint64_t hash = mix(id);
+		uint64_t word = hash & mask;
+		uint64_t select = mix(hash ^ 0x9e3779b97f4a7c15ull);
+		uint64_t bits = 0;
+		uint64_t now = coarse_time();
+		size_t spare = (current + 1) % filters.size();
+
+		if (now >= rotate_at)
+		{
+			rotate(now);
+			spare = (current + 1) % filters.size();
+		}
+
+		if (cleared < filters[spare].size())
+		{
+			size_t end = std::min(cleared + CLEAR_WORDS, filters[spare].size());
+
+			std::fill(filters[spare].begin() + cleared, filters[spare].begin() + end, 0);
+			cleared = end;
+		}
+
+		for (size_t i = 0; i < hashes; i++)
+		{
+			bits |= (uint64_t)1 << ((select >> (i * 6)) & 63);
+		}
+
+		checked_count++;
+
+		for (size_t i = 0; i < filters.size(); i++)
+		{
+			if (i != spare && (filters[i][word] & bits) == bits)
+			{
+				duplicate_count++;
+				return true;
+			}
+		}
+
+		filters[current][word] |= bits;
+
+		return false;
+	}
+
+	inline bool duplicate(const void *data, size_t size)
+	{
+		return duplicate(hash64(data, size));
+	}
+
+	inline bool duplicate(Message &message)
+	{
+		return duplicate(message.data(), message.size());
+	}
+
+	inline uint64_t checked() const
+	{
+		return checked_count;
+	}
+
+	inline uint64_t duplicates() const
+	{
+		return duplicate_count;
+	}
+
+private:
+	static size_t round_words(size_t bits)
+	{
+		size_t words = 1;
+
+		while (words * 64 < bits)
+		{
+			words <<= 1;
+		}
+
+		return words;
+	}
+
+	static uint64_t mix(uint64_t value)
+	{
+		value ^= value >> 33;
+		value *= 0xff51afd7ed558ccdull;
+		value ^= value >> 33;
+		value *= 0xc4ceb9fe1a85ec53ull;
+		value ^= value >> 33;
+
+		return value;
+	}
+
+	static uint64_t coarse_time()
+	{
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+		return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	}
+
+	/* the filter after current is the spare: it is skipped by lookups and wiped a few words per call */
+	void rotate(uint64_t now)
+	{
+		uint64_t elapsed = (now - rotate_at) / generation_time + 1;
+
+		for (uint64_t i = 0; i < std::min<uint64_t>(elapsed, filters.size()); i++)
+		{
+			current = (current + 1) % filters.size();
+			std::fill(filters[current].begin() + std::min(cleared, filters[current].size()), filters[current].end(), 0);
+			cleared = 0;
+		}
+
+		rotate_at += elapsed * generation_time;
+	}
+
+private:
+	static const size_t CLEAR_WORDS = 16;
+
+	Time generation_time;
+	uint64_t mask;
+	size_t hashes;
+	std::vector<std::vector<uint64_t> > filters;
+	size_t current;
+	size_t cleared;
+	uint64_t rotate_at;
+	uint64_t checked_count;
+	uint64_t duplicate_count;
+};
+
+template <typename T>
+class Registry
+{
+public:
+	static void add(Client &client, T *object)
+	{
+		std::lock_guard<std::mutex> lock(mutex());
+
+		objects()[client.client] = object;
+	}
+
+	static void remove(Client &client)
+	{
+		std::lock_guard<std::mutex> lock(mutex());
+
+		objects().erase(client.client);
+	}
+
+	static T *find(emq_client *client)
+	{
+		std::lock_guard<std::mutex> lock(mutex());
+		typename std::map<emq_client*, T*>::iterator it = objects().find(client);
+
+		return it != objects().end() ? it->second : NULL;
+	}
+
+private:
+	static std::map<emq_client*, T*> &objects()
+	{
+		static std::map<emq_client*, T*> map;
+
+		return map;
+	}
+
+	static std::mutex &mutex()
+	{
+		static std::mutex mutex;
+
+		return mutex;
+	}
+};
+
+class Executor
+{
+private:
+	struct Task
+	{
+		std::string name;
+		std::string topic;
+		emq_msg *msg;
+	};
+
+	struct Worker
+	{
+		int cpu;
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable cond;
+		std::deque<Task> tasks;
+		bool stopping;
+		uint64_t start;
+		std::atomic<uint64_t> busy;
+		std::atomic<uint64_t> count;
+	};
+
+public:
+	typedef std::function<void(const std::string&, const std::string&, Message&)> Handler;
+
+	struct ThreadStats
+	{
+		int cpu;
+		uint64_t busy;
+		uint64_t wall;
+		uint64_t tasks;
+	};
+
+	Executor(Client &client, Handler handler, bool local_copy = true) :
+		client(client), handler(handler), local_copy(local_copy), io_cpu(-1), io_start(0), io_count(0),
+		io_clock(0), running(false)
+	{
+	}
+
+	~Executor()
+	{
+		stop();
+
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			delete workers[i];
+		}
+	}
+
+	inline void set_io_cpu(int cpu)
+	{
+		io_cpu = cpu;
+	}
+
+	inline void add_worker(int cpu = -1)
+	{
+		Worker *worker = new Worker;
+
+		worker->cpu = cpu;
+		worker->stopping = false;
+		worker->start = 0;
+		worker->busy = 0;
+		worker->count = 0;
+
+		workers.push_back(worker);
+	}
+
+	bool start()
+	{
+		if (running || !client.connected())
+		{
+			return false;
+		}
+
+		if (workers.empty())
+		{
+			add_worker();
+		}
+
+		running = true;
+
+		Registry<Executor>::add(client, this);
+
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			workers[i]->stopping = false;
+			workers[i]->start = usec();
+			workers[i]->thread = std::thread(&Executor::work, this, workers[i]);
+		}
+
+		return true;
+	}
+
+	int run()
+	{
+		int status;
+
+		pin(io_cpu);
+		pthread_getcpuclockid(pthread_self(), &io_clock);
+		io_start = usec();
+
+		status = client.process();
+
+		return status;
+	}
+
+	void stop()
+	{
+		if (!running)
+		{
+			return;
+		}
+
+		running = false;
+
+		Registry<Executor>::remove(client);
+
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			std::lock_guard<std::mutex> lock(workers[i]->mutex);
+
+			workers[i]->stopping = true;
+			workers[i]->cond.notify_all();
+		}
+
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			workers[i]->thread.join();
+		}
+	}
+
+	inline void stats(std::vector<ThreadStats> &list)
+	{
+		uint64_t now = usec();
+		ThreadStats io;
+
+		io.cpu = io_cpu;
+		io.wall = io_start ? now - io_start : 0;
+		io.busy = 0;
+		io.tasks = io_count;
+
+		if (io_start)
+		{
+			struct timespec ts;
+
+			if (clock_gettime(io_clock, &ts) == 0)
+			{
+				io.busy = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+			}
+		}
+
+		list.push_back(io);
+
+		for (size_t i = 0; i < workers.size(); i++)
+		{
+			ThreadStats worker;
+
+			worker.cpu = workers[i]->cpu;
+			worker.wall = workers[i]->start ? now - workers[i]->start : 0;
+			worker.busy = workers[i]->busy;
+			worker.tasks = workers[i]->count;
+
+			list.push_back(worker);
+		}
+	}
+
+	static int callback(emq_client *client, int, const char *name, const char *topic, const char *, emq_msg *msg)
+	{
+		Executor *executor = Registry<Executor>::find(client);
+
+		if (!executor)
+		{
+			emq_msg_release(msg);
+			return 1;
+		}
+
+		return executor->dispatch(name, topic, msg);
+	}
+
+private:
+	static uint64_t usec()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	static void pin(int cpu)
+	{
+		cpu_set_t set;
+
+		if (cpu < 0)
+		{
+			return;
+		}
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	}
+
+	int dispatch(const char *name, const char *topic, emq_msg *msg)
+	{
+		Worker *worker;
+		Task task;
+
+		task.name = name ? name : "";
+		task.topic = topic ? topic : "";
+		task.msg = msg;
+
+		worker = workers[hash64(task.name.data(), task.name.size()) % workers.size()];
+
+		{
+			std::lock_guard<std::mutex> lock(worker->mutex);
+
+			if (worker->stopping)
+			{
+				emq_msg_release(msg);
+				return 1;
+			}
+
+			worker->tasks.push_back(task);
+		}
+
+		worker->cond.notify_one();
+		io_count++;
+
+		return 0;
+	}
+
+	void work(Worker *worker)
+	{
+		pin(worker->cpu);
+
+		while (true)
+		{
+			std::unique_lock<std::mutex> lock(worker->mutex);
+			uint64_t begin;
+			Task task;
+
+			worker->cond.wait(lock, [worker]()
+			{
+				return worker->stopping || !worker->tasks.empty();
+			});
+
+			/* queued tasks are still handled after stop() so nothing already taken off the server is lost */
+			if (worker->tasks.empty())
+			{
+				break;
+			}
+
+			task = worker->tasks.front();
+			worker->tasks.pop_front();
+			lock.unlock();
+
+			begin = usec();
+
+			if (local_copy)
+			{
+				Message message(emq_msg_data(task.msg), emq_msg_size(task.msg));
+
+				emq_msg_release(task.msg);
+				handler(task.name, task.topic, message);
+			}
+			else
+			{
+				Message message(task.msg);
+
+				handler(task.name, task.topic, message);
+			}
+
+			worker->busy += usec() - begin;
+			worker->count++;
+		}
+	}
+
+private:
+	Executor(const Executor&);
+	void operator=(const Executor&);
+
+private:
+	Client &client;
+	Handler handler;
+	bool local_copy;
+	int io_cpu;
+	std::atomic<uint64_t> io_start;
+	std::atomic<uint64_t> io_count;
+	clockid_t io_clock;
+	std::atomic<bool> running;
+	std::vector<Worker*> workers;
+};
+
+class Chunker
+{
+public:
+	struct Header
+	{
+		uint16_t magic;
+		uint8_t version;
+		uint8_t flags;
+		uint32_t count;
+		uint32_t index;
+		uint32_t reserved;
+		uint64_t id;
+		uint64_t total;
+		uint64_t offset;
+	};
+
+	enum
+	{
+		HEADER_MAGIC = 0x4843,
+		HEADER_VERSION = 1
+	};
+
+	Chunker(size_t max_size) : chunk_size(max_size > sizeof(Header) ? max_size - sizeof(Header) : 1)
+	{
+		std::random_device random;
+
+		next_id = ((uint64_t)random() << 32) ^ random();
+	}
+
+	/* leaves room for the trailers the client's queue hooks add, which count against max_msg_size too */
+	Chunker(size_t max_size, Client &client) :
+		chunk_size(max_size > sizeof(Header) + client.queue.overhead() ?
+			max_size - sizeof(Header) - client.queue.overhead() : 1)
+	{
+		std::random_device random;
+
+		next_id = ((uint64_t)random() << 32) ^ random();
+	}
+
+	inline bool push(Client &client, const std::string &name, const void *data, size_t size)
+	{
+		std::vector<char> buffer;
+		Header header;
+
+		header.magic = HEADER_MAGIC;
+		header.version = HEADER_VERSION;
+		header.flags = 0;
+		header.count = size ? (size + chunk_size - 1) / chunk_size : 1;
+		header.reserved = 0;
+		header.id = next_id++;
+		header.total = size;
+
+		for (header.index = 0; header.index < header.count; header.index++)
+		{
+			size_t part;
+
+			header.offset = (uint64_t)header.index * chunk_size;
+			part = std::min<size_t>(chunk_size, size - header.offset);
+
+			buffer.resize(sizeof(header) + part);
+			memcpy(&buffer[0], &header, sizeof(header));
+			memcpy(&buffer[sizeof(header)], (const char*)data + header.offset, part);
+
+			Message chunk(&buffer[0], buffer.size(), true);
+
+			if (!chunk.msg() || !client.queue.push(name, chunk))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	inline bool push(Client &client, const std::string &name, Message &message)
+	{
+		return push(client, name, message.data(), message.size());
+	}
+
+private:
+	size_t chunk_size;
+	uint64_t next_id;
+};
+
+class Reassembler
+{
+private:
+	struct Pending
+	{
+		std::vector<char> buffer;
+		std::vector<bool> received;
+		uint32_t remaining;
+		uint64_t deadline;
+	};
+
+public:
+	Reassembler(Time timeout = 30000, size_t max_size = 1024 * 1024 * 1024) :
+		timeout(timeout), max_size(max_size), pending_bytes(0), expired_count(0), invalid_count(0)
+	{
+	}
+
+	inline bool add(Message &message, std::vector<char> &out)
+	{
+		Chunker::Header header;
+		const char *data = (const char*)message.data();
+		size_t size = message.size();
+
+		expire();
+
+		if (size < sizeof(header))
+		{
+			return passthrough(data, size, out);
+		}
+
+		memcpy(&header, data, sizeof(header));
+		if (header.magic != Chunker::HEADER_MAGIC || header.version != Chunker::HEADER_VERSION)
+		{
+			return passthrough(data, size, out);
+		}
+
+		data += sizeof(header);
+		size -= sizeof(header);
+
+		if (!header.count || header.index >= header.count || header.total > max_size ||
+			header.offset > header.total || size > header.total - header.offset)
+		{
+			invalid_count++;
+			return false;
+		}
+
+		if (header.count == 1)
+		{
+			out.assign(data, data + size);
+			return true;
+		}
+
+		std::map<uint64_t, Pending>::iterator it = pending.find(header.id);
+
+		if (it == pending.end())
+		{
+			if (pending_bytes + header.total > max_size)
+			{
+				invalid_count++;
+				return false;
+			}
+
+			Pending &entry = pending[header.id];
+
+			entry.buffer.resize(header.total);
+			entry.received.assign(header.count, false);
+			entry.remaining = header.count;
+			entry.deadline = monotonic_time() + timeout;
+
+			pending_bytes += header.total;
+			order.push_back(std::make_pair(entry.deadline, header.id));
+
+			it = pending.find(header.id);
+		}
+
+		Pending &entry = it->second;
+
+		if (entry.received.size() != header.count || entry.buffer.size() != header.total)
+		{
+			invalid_count++;
+			return false;
+		}
+
+		if (entry.received[header.index])
+		{
+			return false;
+		}
+
+		memcpy(&entry.buffer[header.offset], data, size);
+		entry.received[header.index] = true;
+
+		if (--entry.remaining)
+		{
+			return false;
+		}
+
+		out.swap(entry.buffer);
+		pending_bytes -= header.total;
+		pending.erase(it);
+
+		return true;
+	}
+
+	inline size_t expire()
+	{
+		uint64_t now = monotonic_time();
+		size_t expired = 0;
+
+		while (!order.empty() && order.front().first <= now)
+		{
+			std::map<uint64_t, Pending>::iterator it = pending.find(order.front().second);
+
+			if (it != pending.end())
+			{
+				pending_bytes -= it->second.buffer.size();
+				pending.erase(it);
+				expired++;
+			}
+
+			order.pop_front();
+		}
+
+		expired_count += expired;
+
+		return expired;
+	}
+
+	inline size_t incomplete() const
+	{
+		return pending.size();
+	}
+
+	inline uint64_t expired() const
+	{
+		return expired_count;
+	}
+
+	inline uint64_t invalid() const
+	{
+		return invalid_count;
+	}
+
+private:
+	static bool passthrough(const char *data, size_t size, std::vector<char> &out)
+	{
+		out.assign(data, data + size);
+
+		return true;
+	}
+
+private:
+	Time timeout;
+	size_t max_size;
+	size_t pending_bytes;
+	uint64_t expired_count;
+	uint64_t invalid_count;
+	std::map<uint64_t, Pending> pending;
+	std::deque<std::pair<uint64_t, uint64_t> > order;
+};
+
+class Rpc
+{
+public:
+	struct Header
+	{
+		uint16_t magic;
+		uint8_t version;
+		uint8_t flags;
+		uint16_t reply_size;
+		uint16_t reserved;
+		uint64_t id;
+	};
+
+	struct Reply
+	{
+		bool status;
+		std::vector<char> data;
+	};
+
+	enum
+	{
+		HEADER_MAGIC = 0x5052,
+		HEADER_VERSION = 1
+	};
+
+	enum Flags
+	{
+		REQUEST = 0,
+		RESPONSE = 1,
+		ERROR = 2
+	};
+
+	static emq_msg *create(uint8_t flags, uint64_t id, const std::string &reply, const void *data, size_t size,
+		std::vector<char> &buffer)
+	{
+		Header header;
+
+		if (reply.size() > UINT16_MAX)
+		{
+			return NULL;
+		}
+
+		header.magic = HEADER_MAGIC;
+		header.version = HEADER_VERSION;
+		header.flags = flags;
+		header.reply_size = reply.size();
+		header.reserved = 0;
+		header.id = id;
+
+		buffer.resize(sizeof(header) + reply.size() + size);
+		memcpy(&buffer[0], &header, sizeof(header));
+		memcpy(&buffer[sizeof(header)], reply.data(), reply.size());
+		if (size)
+		{
+			memcpy(&buffer[sizeof(header) + reply.size()], data, size);
+		}
+
+		return emq_msg_create(&buffer[0], buffer.size(), true);
+	}
+
+	static bool parse(Message &message, Header *header, std::string *reply)
+	{
+		const char *data = (const char*)message.data();
+
+		if (message.size() < sizeof(*header))
+		{
+			return false;
+		}
+
+		memcpy(header, data, sizeof(*header));
+		if (header->magic != HEADER_MAGIC || header->version != HEADER_VERSION ||
+			message.size() < sizeof(*header) + header->reply_size)
+		{
+			return false;
+		}
+
+		reply->assign(data + sizeof(*header), header->reply_size);
+		message.strip(sizeof(*header) + header->reply_size);
+
+		return true;
+	}
+};
+
+class RpcClient
+{
+public:
+	typedef std::function<void(bool, Message*)> Handler;
+
+private:
+	struct Pending
+	{
+		Handler handler;
+		uint64_t deadline;
+	};
+
+public:
+	RpcClient(Client &sender, Client &receiver, const std::string &reply_queue, Time timeout = 5000) :
+		sender(sender), receiver(receiver), reply_queue(reply_queue), timeout(timeout), next_id(1),
+		running(false), timeout_count(0)
+	{
+	}
+
+	~RpcClient()
+	{
+		stop();
+	}
+
+	bool start()
+	{
+		if (running)
+		{
+			return true;
+		}
+
+		if (reply_queue.size() > UINT16_MAX)
+		{
+			return false;
+		}
+
+		receiver.queue.create(reply_queue, EMQ_MAX_MSG, EMQ_MAX_MSG_SIZE, EMQ_QUEUE_AUTODELETE);
+
+		if (!receiver.queue.declare(reply_queue) ||
+			!receiver.queue.subscribe(reply_queue, EMQ_QUEUE_SUBSCRIBE_MSG, &RpcClient::callback))
+		{
+			return false;
+		}
+
+		running = true;
+		Registry<RpcClient>::add(receiver, this);
+
+		receive_thread = std::thread([this]()
+		{
+			receiver.process();
+		});
+
+		timer_thread = std::thread(&RpcClient::timer, this);
+
+		return true;
+	}
+
+	void stop()
+	{
+		std::vector<char> buffer;
+
+		if (!running)
+		{
+			return;
+		}
+
+		running = false;
+
+		{
+			std::lock_guard<std::mutex> lock(send_mutex);
+			Message wakeup(Rpc::create(Rpc::RESPONSE, 0, std::string(), NULL, 0, buffer));
+
+			/* without the wakeup the receive thread stays blocked in process(), so cut the socket instead */
+			if (!sender.queue.push(reply_queue, wakeup))
+			{
+				::shutdown(receiver.fd(), SHUT_RDWR);
+			}
+		}
+
+		receive_thread.join();
+
+		{
+			std::lock_guard<std::mutex> lock(pending_mutex);
+
+			timer_cond.notify_all();
+		}
+
+		timer_thread.join();
+
+		Registry<RpcClient>::remove(receiver);
+
+		fail_all();
+	}
+
+	inline bool call(const std::string &queue, const void *data, size_t size, Handler handler)
+	{
+		static thread_local std::vector<char> buffer;
+		uint64_t id = next_id++;
+		bool status;
+
+		{
+			std::lock_guard<std::mutex> lock(pending_mutex);
+			Pending &pending = inflight[id];
+
+			pending.handler = handler;
+			pending.deadline = monotonic_time() + timeout;
+			deadlines.push_back(std::make_pair(pending.deadline, id));
+		}
+
+		{
+			Message request(Rpc::create(Rpc::REQUEST, id, reply_queue, data, size, buffer));
+			std::lock_guard<std::mutex> lock(send_mutex);
+
+			status = running && request.msg() && sender.queue.push(queue, request);
+		}
+
+		/* the timer may already have taken the entry; then it owns the handler and the call counts as made */
+		if (!status)
+		{
+			std::lock_guard<std::mutex> lock(pending_mutex);
+
+			return inflight.erase(id) == 0;
+		}
+
+		return status;
+	}
+
+	inline std::future<Rpc::Reply> call(const std::string &queue, const void *data, size_t size)
+	{
+		std::shared_ptr<std::promise<Rpc::Reply> > promise = std::make_shared<std::promise<Rpc::Reply> >();
+		std::future<Rpc::Reply> future = promise->get_future();
+
+		if (!call(queue, data, size, [promise](bool status, Message *message)
+		{
+			Rpc::Reply reply;
+
+			reply.status = status;
+			if (message)
+			{
+				reply.data.assign((char*)message->data(), (char*)message->data() + message->size());
+			}
+
+			promise->set_value(reply);
+		}))
+		{
+			Rpc::Reply reply;
+
+			reply.status = false;
+			promise->set_value(reply);
+		}
+
+		return future;
+	}
+
+	inline size_t inflight_count()
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex);
+
+		return inflight.size();
+	}
+
+	inline uint64_t timeouts()
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex);
+
+		return timeout_count;
+	}
+
+private:
+	static int callback(emq_client *client, int, const char *, const char *, const char *, emq_msg *msg)
+	{
+		RpcClient *rpc = Registry<RpcClient>::find(client);
+		Message message(msg);
+
+		if (!rpc)
+		{
+			return 1;
+		}
+
+		return rpc->complete(message);
+	}
+
+	int complete(Message &message)
+	{
+		Rpc::Header header;
+		std::string reply;
+		Handler handler;
+
+		if (!Rpc::parse(message, &header, &reply))
+		{
+			return !running;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(pending_mutex);
+			std::unordered_map<uint64_t, Pending>::iterator it = inflight.find(header.id);
+
+			if (it != inflight.end())
+			{
+				handler = it->second.handler;
+				inflight.erase(it);
+			}
+		}
+
+		if (handler)
+		{
+			handler(!(header.flags & Rpc::ERROR), &message);
+		}
+
+		return !running;
+	}
+
+	void timer()
+	{
+		std::unique_lock<std::mutex> lock(pending_mutex);
+
+		while (running)
+		{
+			uint64_t now = monotonic_time();
+
+			while (!deadlines.empty() && deadlines.front().first <= now)
+			{
+				std::unordered_map<uint64_t, Pending>::iterator it = inflight.find(deadlines.front().second);
+
+				deadlines.pop_front();
+
+				if (it != inflight.end())
+				{
+					Handler handler = it->second.handler;
+
+					inflight.erase(it);
+					timeout_count++;
+
+					lock.unlock();
+					handler(false, NULL);
+					lock.lock();
+				}
+			}
+
+			timer_cond.wait_for(lock, std::chrono::milliseconds(deadlines.empty() ? timeout :
+				std::min<uint64_t>(deadlines.front().first - now, timeout)));
+		}
+	}
+
+	void fail_all()
+	{
+		std::unordered_map<uint64_t, Pending> list;
+
+		{
+			std::lock_guard<std::mutex> lock(pending_mutex);
+
+			list.swap(inflight);
+			deadlines.clear();
+		}
+
+		for (std::unordered_map<uint64_t, Pending>::iterator it = list.begin(); it != list.end(); ++it)
+		{
+			it->second.handler(false, NULL);
+		}
+	}
+
+private:
+	RpcClient(const RpcClient&);
+	void operator=(const RpcClient&);
+
+private:
+	Client &sender;
+	Client &receiver;
+	std::string reply_queue;
+	Time timeout;
+	std::atomic<uint64_t> next_id;
+	std::atomic<bool> running;
+	std::thread receive_thread;
+	std::thread timer_thread;
+	std::mutex send_mutex;
+	std::mutex pending_mutex;
+	std::condition_variable timer_cond;
+	std::unordered_map<uint64_t, Pending> inflight;
+	std::deque<std::pair<uint64_t, uint64_t> > deadlines;
+	uint64_t timeout_count;
+};
+
+class RpcServer
+{
+public:
+	typedef std::function<bool(Message&, std::vector<char>&)> Handler;
+
+	/* responses go out on sender, or on client when it is NULL. A handle() called from a subscription
+	 * callback runs inside process(), where client cannot make a request of its own, so it needs a
+	 * separate sender connection */
+	RpcServer(Client &client, const std::string &queue, Handler handler, Client *sender = NULL) :
+		client(client), sender(sender ? *sender : client), queue(queue), handler(handler)
+	{
+	}
+
+	inline bool handle(Message &message)
+	{
+		std::vector<char> reply, buffer;
+		Rpc::Header header;
+		std::string reply_queue;
+		bool status;
+
+		if (!Rpc::parse(message, &header, &reply_queue) || header.flags != Rpc::REQUEST)
+		{
+			return false;
+		}
+
+		status = handler(message, reply);
+
+		Message response(Rpc::create(status ? Rpc::RESPONSE : Rpc::RESPONSE | Rpc::ERROR, header.id,
+			std::string(), reply.empty() ? NULL : &reply[0], reply.size(), buffer));
+
+		return response.msg() && sender.queue.push(reply_queue, response);
+	}
+
+	inline size_t poll(size_t max = 0)
+	{
+		size_t count = 0;
+
+		while (!max || count < max)
+		{
+			Message message = client.queue.pop(queue, 0);
+
+			if (!message.msg())
+			{
+				break;
+			}
+
+			handle(message);
+			count++;
+		}
+
+		return count;
+	}
+
+private:
+	Client &client;
+	Client &sender;
+	std::string queue;
+	Handler handler;
+};
+
+class PriorityQueue
+{
+public:
+	typedef std::function<bool(size_t, Message&)> Handler;
+
+	PriorityQueue(const std::string &name, size_t levels, bool strict = true, Time timeout = 0) :
+		name(name), levels(levels ? levels : 1), consumer(timeout), tracer(NULL)
+	{
+		for (size_t i = 0; i < this->levels; i++)
+		{
+			size_t rank = this->levels - 1 - i;
+
+			if (strict)
+			{
+				consumer.add(lane(i), 1, rank, i != 0);
+			}
+			else
+			{
+				consumer.add(lane(i), 1u << std::min<size_t>(rank, 16), 0, i != 0);
+			}
+
+			indexes[lane(i)] = i;
+		}
+	}
+
+	inline std::string lane(size_t level) const
+	{
+		std::ostringstream out;
+
+		out << name << ".p" << std::min(level, levels - 1);
+
+		return out.str();
+	}
+
+	inline bool create(Client &client, uint32_t max_msg, uint32_t max_msg_size, uint32_t flags)
+	{
+		for (size_t i = 0; i < levels; i++)
+		{
+			int exist;
+
+			if (client.queue.exist(lane(i), &exist) && exist)
+			{
+				continue;
+			}
+
+			if (!client.queue.create(lane(i), max_msg, max_msg_size, flags))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	inline void set_tracer(Tracer *tracer)
+	{
+		this->tracer = tracer;
+	}
+
+	inline bool push(Client &client, size_t level, Message &message)
+	{
+		std::string target = lane(level);
+
+		if (!tracer)
+		{
+			return client.queue.push(target, message);
+		}
+
+		Message traced(tracer->wrap(target, message));
+
+		return traced.msg() && client.queue.push(target, traced);
+	}
+
+	inline size_t poll(Client &client, Handler handler, size_t max = 0)
+	{
+		return consumer.poll(client, [this, &handler](const std::string &target, Message &message)
+		{
+			if (tracer)
+			{
+				tracer->receive(target, message);
+			}
+
+			return handler(indexes[target], message);
+		}, max);
+	}
+
+	inline Time idle_time() const
+	{
+		return consumer.idle_time();
+	}
+
+	inline bool latency(size_t level, Histogram *histogram)
+	{
+		Tracer::Stats stats;
+
+		if (!tracer || !tracer->stats(lane(level), &stats))
+		{
+			return false;
+		}
+
+		*histogram = stats.residence;
+
+		return true;
+	}
+
+private:
+	std::string name;
+	size_t levels;
+	MultiQueueConsumer consumer;
+	Tracer *tracer;
+	std::map<std::string, size_t> indexes;
+};
+
+class Scheduler
+{
+private:
+	enum Target
+	{
+		TARGET_QUEUE,
+		TARGET_ROUTE,
+		TARGET_CHANNEL
+	};
+
+	enum
+	{
+		WHEEL_BITS = 8,
+		WHEEL_SIZE = 1 << WHEEL_BITS,
+		WHEEL_MASK = WHEEL_SIZE - 1,
+		WHEEL_LEVELS = 4,
+		RECORD_ADD = 1,
+		RECORD_DONE = 2
+	};
+
+	struct Entry
+	{
+		uint64_t id;
+		uint64_t due;
+		uint64_t deadline;
+		Target target;
+		std::string name;
+		std::string key;
+		emq_msg *msg;
+		Entry *next;
+	};
+
+	struct Record
+	{
+		uint32_t size;
+		uint32_t checksum;
+		uint8_t type;
+		uint8_t target;
+		uint16_t name_size;
+		uint16_t key_size;
+		uint16_t reserved;
+		uint32_t data_size;
+		uint32_t reserved2;
+		uint64_t id;
+		uint64_t deadline;
+	};
+
+public:
+	Scheduler(Time resolution = 1, size_t max_pending = 0, Time retry = 100) :
+		resolution(resolution ? resolution : 1), max_pending(max_pending), retry(retry),
+		tick(monotonic_time() / this->resolution), ready(NULL), ready_tail(NULL), next_id(1), fd(-1),
+		journal_records(0), pending_count(0), released_count(0), running(false)
+	{
+		memset(wheels, 0, sizeof(wheels));
+	}
+
+	~Scheduler()
+	{
+		stop();
+
+		for (size_t level = 0; level < WHEEL_LEVELS; level++)
+		{
+			for (size_t slot = 0; slot < WHEEL_SIZE; slot++)
+			{
+				release(wheels[level][slot]);
+			}
+		}
+
+		release(ready);
+
+		if (fd != -1)
+		{
+			::close(fd);
+		}
+	}
+
+	bool open(const std::string &path)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::map<uint64_t, Entry*> entries;
+		std::vector<char> data;
+		uint64_t now = realtime_usec() / 1000;
+		size_t offset = 0;
+		char buffer[65536];
+		ssize_t size;
+
+		if (fd != -1)
+		{
+			return false;
+		}
+
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+		if (fd == -1)
+		{
+			return false;
+		}
+
+		this->path = path;
+
+		while ((size = read(fd, buffer, sizeof(buffer))) > 0)
+		{
+			data.insert(data.end(), buffer, buffer + size);
+		}
+
+		while (offset + sizeof(Record) <= data.size())
+		{
+			Record record;
+			const char *ptr = &data[offset];
+
+			memcpy(&record, ptr, sizeof(record));
+			if (record.size != sizeof(record) + record.name_size + record.key_size + record.data_size ||
+				record.size > data.size() - offset ||
+				record.checksum != checksum(ptr + 8, record.size - 8))
+			{
+				break;
+			}
+
+			ptr += sizeof(record);
+
+			if (record.type == RECORD_ADD)
+			{
+				Entry *entry = new Entry;
+
+				entry->id = record.id;
+				entry->deadline = record.deadline;
+				entry->target = (Target)record.target;
+				entry->name.assign(ptr, record.name_size);
+				entry->key.assign(ptr + record.name_size, record.key_size);
+				entry->msg = emq_msg_create((void*)(ptr + record.name_size + record.key_size),
+					record.data_size, false);
+				entry->next = NULL;
+
+				delete_entry(entries[record.id]);
+				entries[record.id] = entry;
+			}
+			else
+			{
+				delete_entry(entries[record.id]);
+				entries.erase(record.id);
+			}
+
+			next_id = std::max(next_id, record.id + 1);
+			offset += record.size;
+		}
+
+		if (offset != data.size() && ftruncate(fd, offset) == -1)
+		{
+			return false;
+		}
+
+		journal_records = 0;
+
+		for (std::map<uint64_t, Entry*>::iterator it = entries.begin(); it != entries.end(); ++it)
+		{
+			Entry *entry = it->second;
+
+			if (!entry)
+			{
+				continue;
+			}
+
+			entry->due = tick + (entry->deadline > now ? (entry->deadline - now) / resolution : 0);
+			insert(entry);
+			pending_count++;
+			journal_records++;
+		}
+
+		return true;
+	}
+
+	inline bool queue(const std::string &name, Message &message, Time delay)
+	{
+		return schedule(TARGET_QUEUE, name, std::string(), message, delay);
+	}
+
+	inline bool route(const std::string &name, const std::string &key, Message &message, Time delay)
+	{
+		return schedule(TARGET_ROUTE, name, key, message, delay);
+	}
+
+	inline bool publish(const std::string &name, const std::string &topic, Message &message, Time delay)
+	{
+		return schedule(TARGET_CHANNEL, name, topic, message, delay);
+	}
+
+	inline size_t advance(Client &client)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		uint64_t now = monotonic_time() / resolution;
+		size_t count = 0;
+
+		while (tick < now)
+		{
+			tick++;
+
+			for (size_t level = 1; level < WHEEL_LEVELS; level++)
+			{
+				if ((tick >> (WHEEL_BITS * level - WHEEL_BITS)) & WHEEL_MASK)
+				{
+					break;
+				}
+
+				cascade(level, (tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+			}
+
+			append_ready(take(wheels[0][tick & WHEEL_MASK]));
+		}
+
+		while (ready)
+		{
+			Entry *entry = ready;
+			bool status;
+
+			ready = entry->next;
+			if (!ready)
+			{
+				ready_tail = NULL;
+			}
+
+			entry->next = NULL;
+
+			lock.unlock();
+			status = send(client, entry);
+			lock.lock();
+
+			if (!status)
+			{
+				entry->due = tick + std::max<uint64_t>(retry / resolution, 1);
+				insert(entry);
+				break;
+			}
+
+			journal(RECORD_DONE, entry);
+			delete_entry(entry);
+			pending_count--;
+			released_count++;
+			count++;
+		}
+
+		compact();
+
+		return count;
+	}
+
+	bool start(Client &client)
+	{
+		if (running)
+		{
+			return false;
+		}
+
+		running = true;
+		thread = std::thread([this, &client]()
+		{
+			while (running)
+			{
+				advance(client);
+				std::this_thread::sleep_for(std::chrono::milliseconds(resolution));
+			}
+		});
+
+		return true;
+	}
+
+	void stop()
+	{
+		if (!running)
+		{
+			return;
+		}
+
+		running = false;
+		thread.join();
+	}
+
+	inline size_t pending()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return pending_count;
+	}
+
+	inline uint64_t released()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return released_count;
+	}
+
+private:
+	static void delete_entry(Entry *entry)
+	{
+		if (entry)
+		{
+			emq_msg_release(entry->msg);
+			delete entry;
+		}
+	}
+
+	static void release(Entry *entry)
+	{
+		while (entry)
+		{
+			Entry *next = entry->next;
+
+			delete_entry(entry);
+			entry = next;
+		}
+	}
+
+	static Entry *take(Entry *&list)
+	{
+		Entry *entry = list;
+
+		list = NULL;
+
+		return entry;
+	}
+
+	static bool send(Client &client, Entry *entry)
+	{
+		Message message(entry->msg);
+		bool status;
+
+		switch (entry->target)
+		{
+			case TARGET_QUEUE:
+				status = client.queue.push(entry->name, message);
+				break;
+			case TARGET_ROUTE:
+				status = client.route.push(entry->name, entry->key, message);
+				break;
+			default:
+				status = client.channel.publish(entry->name, entry->key, message);
+				break;
+		}
+
+		message.release();
+
+		return status;
+	}
+
+	bool schedule(Target target, const std::string &name, const std::string &key, Message &message, Time delay)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		Entry *entry;
+
+		if (!message.msg() || (max_pending && pending_count >= max_pending))
+		{
+			return false;
+		}
+
+		entry = new Entry;
+		entry->id = next_id++;
+		entry->due = monotonic_time() / resolution + (delay + resolution - 1) / resolution;
+		entry->deadline = realtime_usec() / 1000 + delay;
+		entry->target = target;
+		entry->name = name;
+		entry->key = key;
+		entry->msg = message.msg();
+		entry->next = NULL;
+
+		if (!journal(RECORD_ADD, entry))
+		{
+			delete entry;
+			return false;
+		}
+
+		entry->msg = message.release();
+		insert(entry);
+		pending_count++;
+
+		return true;
+	}
+
+	void insert(Entry *entry)
+	{
+		uint64_t delta;
+
+		if (entry->due <= tick)
+		{
+			append_ready(entry);
+			return;
+		}
+
+		delta = entry->due - tick;
+
+		for (size_t level = 0; level < WHEEL_LEVELS; level++)
+		{
+			if (delta < ((uint64_t)1 << (WHEEL_BITS * (level + 1))) || level == WHEEL_LEVELS - 1)
+			{
+				uint64_t due = std::min(entry->due, tick + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1);
+				Entry *&slot = wheels[level][(due >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+				entry->next = slot;
+				slot = entry;
+				return;
+			}
+		}
+	}
+
+	void cascade(size_t level, size_t slot)
+	{
+		Entry *entry = take(wheels[level][slot]);
+
+		while (entry)
+		{
+			Entry *next = entry->next;
+
+			entry->next = NULL;
+			insert(entry);
+			entry = next;
+		}
+	}
+
+	void append_ready(Entry *list)
+	{
+		while (list)
+		{
+			Entry *next = list->next;
+
+			list->next = NULL;
+
+			if (ready_tail)
+			{
+				ready_tail->next = list;
+			}
+			else
+			{
+				ready = list;
+			}
+
+			ready_tail = list;
+			list = next;
+		}
+	}
+
+	bool journal(uint8_t type, Entry *entry)
+	{
+		if (fd == -1)
+		{
+			return true;
+		}
+
+		if (!write_record(fd, type, entry))
+		{
+			return false;
+		}
+
+		journal_records++;
+
+		return true;
+	}
+
+	static bool write_record(int fd, uint8_t type, Entry *entry)
+	{
+		std::vector<char> buffer;
+		Record record;
+		size_t data_size = type == RECORD_ADD ? emq_msg_size(entry->msg) : 0;
+
+		memset(&record, 0, sizeof(record));
+		record.type = type;
+		record.id = entry->id;
+
+		if (type == RECORD_ADD)
+		{
+			record.target = entry->target;
+			record.name_size = entry->name.size();
+			record.key_size = entry->key.size();
+			record.data_size = data_size;
+			record.deadline = entry->deadline;
+		}
+
+		record.size = sizeof(record) + record.name_size + record.key_size + record.data_size;
+
+		buffer.resize(record.size);
+		memcpy(&buffer[0], &record, sizeof(record));
+
+		if (type == RECORD_ADD)
+		{
+			memcpy(&buffer[sizeof(record)], entry->name.data(), entry->name.size());
+			memcpy(&buffer[sizeof(record) + entry->name.size()], entry->key.data(), entry->key.size());
+			if (data_size)
+			{
+				memcpy(&buffer[sizeof(record) + entry->name.size() + entry->key.size()],
+					emq_msg_data(entry->msg), data_size);
+			}
+		}
+
+		record.checksum = checksum(&buffer[8], buffer.size() - 8);
+		memcpy(&buffer[4], &record.checksum, sizeof(record.checksum));
+
+		return write(fd, &buffer[0], buffer.size()) == (ssize_t)buffer.size();
+	}
+
+	void compact()
+	{
+		std::string tmp = path + ".tmp";
+		bool status = true;
+		int tmp_fd;
+
+		if (fd == -1 || journal_records < 1024 || journal_records < pending_count * 4)
+		{
+			return;
+		}
+
+		tmp_fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+		if (tmp_fd == -1)
+		{
+			return;
+		}
+
+		for (size_t level = 0; level < WHEEL_LEVELS; level++)
+		{
+			for (size_t slot = 0; slot < WHEEL_SIZE; slot++)
+			{
+				for (Entry *entry = wheels[level][slot]; entry && status; entry = entry->next)
+				{
+					status = write_record(tmp_fd, RECORD_ADD, entry);
+				}
+			}
+		}
+
+		for (Entry *entry = ready; entry && status; entry = entry->next)
+		{
+			status = write_record(tmp_fd, RECORD_ADD, entry);
+		}
+
+		if (!status || fsync(tmp_fd) == -1 || rename(tmp.c_str(), path.c_str()) == -1)
+		{
+			::close(tmp_fd);
+			unlink(tmp.c_str());
+			return;
+		}
+
+		::close(fd);
+		fd = tmp_fd;
+		journal_records = pending_count;
+	}
+
+private:
+	Scheduler(const Scheduler&);
+	void operator=(const Scheduler&);
+
+private:
+	Time resolution;
+	size_t max_pending;
+	Time retry;
+	uint64_t tick;
+	Entry *wheels[WHEEL_LEVELS][WHEEL_SIZE];
+	Entry *ready;
+	Entry *ready_tail;
+	uint64_t next_id;
+	std::string path;
+	int fd;
+	size_t journal_records;
+	size_t pending_count;
+	uint64_t released_count;
+	std::atomic<bool> running;
+	std::thread thread;
+	std::mutex mutex;
+};
+
+class ConsumerGroup
+{
+private:
+	struct Worker
+	{
+		Client *client;
+		std::atomic<bool> running;
+		std::thread thread;
+	};
+
+public:
+	typedef std::function<Client*()> Factory;
+	typedef std::function<bool(Message&)> Handler;
+
+	ConsumerGroup(const std::string &queue, Factory factory, Handler handler,
+		size_t min_workers = 1, size_t max_workers = 8, Time target_lag = 1000, Time interval = 1000,
+		double smoothing = 0.3, Time timeout = 0) :
+		queue(queue), factory(factory), handler(handler),
+		min_workers(std::max<size_t>(min_workers, 1)), max_workers(std::max(max_workers, min_workers)),
+		target_lag(target_lag ? target_lag : 1), interval(interval ? interval : 1),
+		smoothing(smoothing > 0 && smoothing <= 1 ? smoothing : 1), timeout(timeout), control(NULL),
+		running(false), processed(0), busy_time(0), service_time(0), arrival_rate(0), backlog(0),
+		lag_estimate(0), correction(0), desired(0)
+	{
+	}
+
+	~ConsumerGroup()
+	{
+		stop();
+	}
+
+	inline bool start()
+	{
+		int queue_size = 0;
+
+		if (running)
+		{
+			return true;
+		}
+
+		control = factory();
+		if (!control || !control->connected())
+		{
+			release(control);
+			control = NULL;
+			return false;
+		}
+
+		if (control->queue.size(queue, &queue_size) && queue_size > 0)
+		{
+			backlog = queue_size;
+		}
+
+		running = true;
+
+		while (workers.size() < min_workers && grow())
+		{
+		}
+
+		desired = (double)workers.size();
+		controller = std::thread(&ConsumerGroup::run, this);
+
+		return true;
+	}
+
+	inline void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (!running)
+			{
+				return;
+			}
+
+			running = false;
+			cond.notify_all();
+		}
+
+		controller.join();
+
+		while (!workers.empty())
+		{
+			shrink();
+		}
+
+		release(control);
+		control = NULL;
+	}
+
+	inline size_t size()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return workers.size();
+	}
+
+	inline uint64_t queue_size()
+	{
+		return backlog;
+	}
+
+	inline double lag()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return lag_estimate;
+	}
+
+	inline double rate()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+
+		return arrival_rate;
+	}
+
+private:
+	static void release(Client *client)
 	{
 		if (client)
 		{
-			emq_disconnect(client);
-			client = NULL;
+			client->disconnect();
+			delete client;
+		}
+	}
+
+	bool grow()
+	{
+		Client *client = factory();
+		Worker *worker;
+
+		if (!client || !client->connected())
+		{
+			release(client);
+			return false;
+		}
+
+		worker = new Worker;
+		worker->client = client;
+		worker->running = true;
+		worker->thread = std::thread(&ConsumerGroup::consume, this, worker);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		workers.push_back(worker);
+
+		return true;
+	}
+
+	void shrink()
+	{
+		Worker *worker;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			worker = workers.back();
+			workers.pop_back();
+		}
+
+		worker->running = false;
+		worker->thread.join();
+
+		release(worker->client);
+		delete worker;
+	}
+
+	void consume(Worker *worker)
+	{
+		Time idle = 1;
+
+		while (worker->running)
+		{
+			/* service time covers the pop and confirm round trips, not just the handler */
+			std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+			Message message = worker->client->queue.pop(queue, timeout);
+
+			if (!message.msg())
+			{
+				std::this_thread::sleep_for(std::chrono::milliseconds(idle));
+				idle = std::min<Time>(idle * 2, 100);
+				continue;
+			}
+
+			idle = 1;
+
+			if (handler(message) && timeout)
+			{
+				worker->client->queue.confirm(queue, message.tag());
+			}
+
+			busy_time += std::chrono::duration_cast<std::chrono::microseconds>(
+				std::chrono::steady_clock::now() - begin).count();
+			processed++;
+		}
+	}
+
+	void update(double elapsed)
+	{
+		uint64_t count = processed.exchange(0);
+		uint64_t busy = busy_time.exchange(0);
+		uint64_t previous = backlog;
+		int queue_size = 0;
+		size_t current;
+
+		if (!control->queue.size(queue, &queue_size) || queue_size < 0)
+		{
+			return;
+		}
+
+		backlog = queue_size;
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		current = workers.size();
+
+		if (count)
+		{
+			service_time = service_time ? smoothing * ((double)busy / count) + (1 - smoothing) * service_time :
+				(double)busy / count;
+		}
+
+		arrival_rate = smoothing * std::max(((double)count + (double)queue_size - (double)previous) / elapsed, 0.0) +
+			(1 - smoothing) * arrival_rate;
+
+		lag_estimate = current && service_time ? (double)queue_size * service_time / 1000 / current : 0;
+
+		/* a backlog that keeps growing past the target lag means the model underestimates the load */
+		if (lag_estimate > target_lag && (uint64_t)queue_size >= previous)
+		{
+			correction = std::min(correction + 1, (double)max_workers);
+		}
+		else
+		{
+			correction *= 1 - smoothing;
+		}
+
+		if (service_time)
+		{
+			double target = arrival_rate * service_time / 1e6 +
+				(double)queue_size * service_time / 1000 / target_lag;
+
+			desired = smoothing * target + (1 - smoothing) * desired;
+		}
+	}
+
+	void run()
+	{
+		std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+		while (true)
+		{
+			std::chrono::steady_clock::time_point now;
+			size_t current, wanted;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+
+				cond.wait_for(lock, std::chrono::milliseconds(interval));
+				if (!running)
+				{
+					break;
+				}
+			}
+
+			now = std::chrono::steady_clock::now();
+			update(std::chrono::duration<double>(now - last).count());
+			last = now;
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+
+				current = workers.size();
+				wanted = std::min(std::max((size_t)std::ceil(desired + correction), min_workers), max_workers);
+			}
+
+			if (wanted > current)
+			{
+				while (current++ < wanted && grow())
+				{
+				}
+			}
+			else if (wanted < current)
+			{
+				shrink();
+			}
+		}
+	}
+
+private:
+	ConsumerGroup(const ConsumerGroup&);
+	void operator=(const ConsumerGroup&);
+
+private:
+	std::string queue;
+	Factory factory;
+	Handler handler;
+	size_t min_workers;
+	size_t max_workers;
+	Time target_lag;
+	Time interval;
+	double smoothing;
+	Time timeout;
+	Client *control;
+	bool running;
+	std::atomic<uint64_t> processed;
+	std::atomic<uint64_t> busy_time;
+	double service_time;
+	double arrival_rate;
+	std::atomic<uint64_t> backlog;
+	double lag_estimate;
+	double correction;
+	double desired;
+	std::vector<Worker*> workers;
+	std::thread controller;
+	std::mutex mutex;
+	std::condition_variable cond;
+};
+
+class BatchConsumer
+{
+private:
+	struct Pending
+	{
+		std::deque<Message> messages;
+		uint64_t deadline;
+	};
+
+public:
+	typedef std::deque<Message> Batch;
+	typedef std::function<bool(const std::string&, Batch&)> Handler;
+
+	BatchConsumer(Client &client, Handler handler, size_t max_size = 100, Time max_delay = 100,
+		bool confirm = true) :
+		client(client), handler(handler), max_size(max_size ? max_size : 1), max_delay(max_delay),
+		confirm(confirm), running(false), processing(false)
+	{
+		Registry<BatchConsumer>::add(client, this);
+	}
+
+	~BatchConsumer()
+	{
+		Registry<BatchConsumer>::remove(client);
+	}
+
+	inline bool subscribe(const std::string &name)
+	{
+		return client.queue.subscribe(name, EMQ_QUEUE_SUBSCRIBE_MSG, callback);
+	}
+
+	inline bool unsubscribe(const std::string &name)
+	{
+		std::map<std::string, Pending>::iterator it = pending.find(name);
+
+		if (it != pending.end())
+		{
+			flush(it->first, it->second);
+			pending.erase(it);
+		}
+
+		return client.queue.unsubscribe(name);
+	}
+
+	bool run()
+	{
+		struct pollfd pfd;
+		bool status = true;
+
+		running = true;
+
+		while (running && status)
+		{
+			uint64_t now = monotonic_time();
+			uint64_t deadline = flush(now);
+			int ready = 1;
+
+			/* a blocking process() would hold a partial batch past its deadline and ignore stop(), so it is
+			 * entered only with data already buffered by libemq or readable on the socket */
+			if (!client.buffered())
+			{
+				pfd.fd = client.fd();
+				pfd.events = POLLIN;
+				pfd.revents = 0;
+
+				ready = ::poll(&pfd, 1, deadline ? (int)(deadline > now ? deadline - now : 0) : 100);
+			}
+
+			if (ready > 0)
+			{
+				processing = true;
+				status = client.process();
+				processing = false;
+			}
+			else if (ready < 0 && errno != EINTR)
+			{
+				status = false;
+			}
+		}
+
+		flush(0);
+
+		return status;
+	}
+
+	inline void stop()
+	{
+		running = false;
+	}
+
+	inline size_t size()
+	{
+		size_t count = 0;
+
+		for (std::map<std::string, Pending>::iterator it = pending.begin(); it != pending.end(); ++it)
+		{
+			count += it->second.messages.size();
+		}
+
+		return count;
+	}
+
+	static int callback(emq_client *client, int, const char *name, const char *, const char *, emq_msg *msg)
+	{
+		BatchConsumer *consumer = Registry<BatchConsumer>::find(client);
+
+		if (!consumer)
+		{
+			emq_msg_release(msg);
+			return 1;
+		}
+
+		return consumer->add(name, msg);
+	}
+
+private:
+	int add(const std::string &name, emq_msg *msg)
+	{
+		Pending &batch = pending[name];
+
+		if (batch.messages.empty())
+		{
+			batch.deadline = monotonic_time() + max_delay;
+		}
+
+		batch.messages.emplace_back(msg);
+
+		if (batch.messages.size() >= max_size || monotonic_time() >= batch.deadline)
+		{
+			flush(name, batch);
+		}
+
+		return !running || !batch.messages.empty();
+	}
+
+	uint64_t flush(uint64_t now)
+	{
+		uint64_t next = 0;
+
+		for (std::map<std::string, Pending>::iterator it = pending.begin(); it != pending.end(); ++it)
+		{
+			if (it->second.messages.empty())
+			{
+				continue;
+			}
+
+			if (!now || now >= it->second.deadline)
+			{
+				flush(it->first, it->second);
+			}
+			else if (!next || it->second.deadline < next)
+			{
+				next = it->second.deadline;
+			}
+		}
+
+		return next;
+	}
+
+	void flush(const std::string &name, Pending &batch)
+	{
+		if (batch.messages.empty())
+		{
+			return;
+		}
+
+		if (handler(name, batch.messages) && confirm)
+		{
+			if (processing)
+			{
+				client.set_noack_mode(true);
+			}
+
+			for (Batch::iterator it = batch.messages.begin(); it != batch.messages.end(); ++it)
+			{
+				client.queue.confirm(name, it->tag());
+			}
+
+			if (processing)
+			{
+				client.set_noack_mode(false);
+			}
+		}
+
+		batch.messages.clear();
+	}
+
+private:
+	BatchConsumer(const BatchConsumer&);
+	void operator=(const BatchConsumer&);
+
+private:
+	Client &client;
+	Handler handler;
+	size_t max_size;
+	Time max_delay;
+	bool confirm;
+	std::atomic<bool> running;
+	bool processing;
+	std::map<std::string, Pending> pending;
+};
+
+class Cluster
+{
+private:
+	struct Node
+	{
+		std::string endpoint;
+		Client *client;
+	};
+
+public:
+	class QueueRouter
+	{
+	public:
+		inline bool create(const std::string &name, uint32_t max_msg, uint32_t max_msg_size, uint32_t flags)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->queue.create(name, max_msg, max_msg_size, flags);
+		}
+
+		inline bool declare(const std::string &name)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->queue.declare(name);
+		}
+
+		inline bool remove(const std::string &name)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->queue.remove(name);
+		}
+
+		inline bool exist(const std::string &name, int *queue_exist)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->queue.exist(name, queue_exist);
+		}
+
+		inline bool size(const std::string &name, int *queue_size)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->queue.size(name, queue_size);
+		}
+
+		inline bool push(const std::string &name, Message &message)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->queue.push(name, message);
+		}
+
+		inline Message get(const std::string &name)
+		{
+			Client *client = cluster->client(name);
+
+			return client ? client->queue.get(name) : Message();
+		}
+
+		inline Message pop(const std::string &name, Time timeout)
+		{
+			Client *client = cluster->client(name);
+
+			return client ? client->queue.pop(name, timeout) : Message();
+		}
+
+		inline bool confirm(const std::string &name, Tag tag)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->queue.confirm(name, tag);
+		}
+
+		inline bool purge(const std::string &name)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->queue.purge(name);
+		}
+
+		friend Cluster;
+
+	private:
+		Cluster *cluster;
+	};
+
+	/* a route only reaches queues on its own node, so bound queues should share its {hash tag} */
+	class RouteRouter
+	{
+	public:
+		inline bool create(const std::string &name, uint32_t flags)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->route.create(name, flags);
+		}
+
+		inline bool remove(const std::string &name)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->route.remove(name);
+		}
+
+		inline bool bind(const std::string &name, const std::string &queue, const std::string &key)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->route.bind(name, queue, key);
+		}
+
+		inline bool unbind(const std::string &name, const std::string &queue, const std::string &key)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->route.unbind(name, queue, key);
+		}
+
+		inline bool push(const std::string &name, const std::string &key, Message &message)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->route.push(name, key, message);
+		}
+
+		friend Cluster;
+
+	private:
+		Cluster *cluster;
+	};
+
+	class ChannelRouter
+	{
+	public:
+		inline bool create(const std::string &name, uint32_t flags)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->channel.create(name, flags);
+		}
+
+		inline bool remove(const std::string &name)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->channel.remove(name);
+		}
+
+		inline bool publish(const std::string &name, const std::string &topic, Message &message)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->channel.publish(name, topic, message);
+		}
+
+		inline bool subscribe(const std::string &name, const std::string &topic, Callback callback)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->channel.subscribe(name, topic, callback);
+		}
+
+		inline bool unsubscribe(const std::string &name, const std::string &topic)
+		{
+			Client *client = cluster->client(name);
+
+			return client && client->channel.unsubscribe(name, topic);
+		}
+
+		friend Cluster;
+
+	private:
+		Cluster *cluster;
+	};
+
+	Cluster(size_t replicas = 160) : replicas(replicas ? replicas : 1)
+	{
+		queue.cluster = this;
+		route.cluster = this;
+		channel.cluster = this;
+	}
+
+	~Cluster()
+	{
+		disconnect();
+	}
+
+	inline bool add(const std::string &addr, int port, const ConnectOptions &options = ConnectOptions())
+	{
+		std::ostringstream endpoint;
+
+		endpoint << addr << ":" << port;
+
+		return insert(endpoint.str(), new Client(addr, port, options));
+	}
+
+	inline bool add(const std::string &path, const ConnectOptions &options = ConnectOptions())
+	{
+		return insert(path, new Client(path, options));
+	}
+
+	inline bool remove(const std::string &endpoint)
+	{
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			if (nodes[i].endpoint == endpoint)
+			{
+				nodes[i].client->disconnect();
+				delete nodes[i].client;
+				nodes.erase(nodes.begin() + i);
+				rebuild();
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	inline Client *client(const std::string &name)
+	{
+		size_t start = name.find('{');
+		size_t end = start != std::string::npos ? name.find('}', start + 1) : std::string::npos;
+		uint64_t hash = end != std::string::npos && end > start + 1 ?
+			hash64(name.data() + start + 1, end - start - 1) : hash64(name.data(), name.size());
+		std::vector<std::pair<uint64_t, size_t> >::const_iterator it =
+			std::lower_bound(ring.begin(), ring.end(), std::make_pair(hash, (size_t)0));
+
+		if (ring.empty())
+		{
+			return NULL;
+		}
+
+		if (it == ring.end())
+		{
+			it = ring.begin();
 		}
+
+		return nodes[it->second].client;
 	}
 
-	inline int process()
+	inline Client *client(size_t index)
 	{
-		int status = emq_process(client);
+		return index < nodes.size() ? nodes[index].client : NULL;
+	}
 
-		return status == EMQ_STATUS_OK;
+	inline const std::string &endpoint(size_t index)
+	{
+		return nodes[index].endpoint;
 	}
 
-	inline void set_noack_mode(bool mode)
+	inline size_t size()
 	{
-		if (mode)
+		return nodes.size();
+	}
+
+	inline bool auth(const std::string &name, const std::string &password)
+	{
+		bool status = true;
+
+		for (size_t i = 0; i < nodes.size(); i++)
 		{
-			emq_noack_enable(client);
+			status &= nodes[i].client->auth(name, password);
 		}
-		else
+
+		return status;
+	}
+
+	inline bool ping()
+	{
+		bool status = true;
+
+		for (size_t i = 0; i < nodes.size(); i++)
 		{
-			emq_noack_disable(client);
+			status &= nodes[i].client->ping();
 		}
+
+		return status;
 	}
 
-	inline std::string last_error()
+	inline bool status(std::vector<Stat> &list)
 	{
-		return emq_last_error(client);
+		bool status = true;
+
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			Stat stat;
+
+			memset(&stat, 0, sizeof(stat));
+			status &= nodes[i].client->status(&stat);
+			list.push_back(stat);
+		}
+
+		return status;
+	}
+
+	inline bool save(bool async)
+	{
+		bool status = true;
+
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			status &= nodes[i].client->save(async);
+		}
+
+		return status;
+	}
+
+	inline bool flush(uint32_t flags)
+	{
+		bool status = true;
+
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			status &= nodes[i].client->flush(flags);
+		}
+
+		return status;
+	}
+
+	template <typename Allocator>
+	inline bool queues(std::vector<Queue, Allocator> &list)
+	{
+		bool status = true;
+
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			status &= nodes[i].client->queue.list(list);
+		}
+
+		return status;
+	}
+
+	template <typename Allocator>
+	inline bool routes(std::vector<Route, Allocator> &list)
+	{
+		bool status = true;
+
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			status &= nodes[i].client->route.list(list);
+		}
+
+		return status;
+	}
+
+	template <typename Allocator>
+	inline bool channels(std::vector<Channel, Allocator> &list)
+	{
+		bool status = true;
+
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			status &= nodes[i].client->channel.list(list);
+		}
+
+		return status;
+	}
+
+	inline void disconnect()
+	{
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			nodes[i].client->disconnect();
+			delete nodes[i].client;
+		}
+
+		nodes.clear();
+		ring.clear();
 	}
 
 private:
-	void init()
+	bool insert(const std::string &endpoint, Client *client)
 	{
-		user.set_client(client);
-		queue.set_client(client);
-		route.set_client(client);
-		channel.set_client(client);
+		Node node;
+
+		if (!client->connected())
+		{
+			delete client;
+			return false;
+		}
+
+		node.endpoint = endpoint;
+		node.client = client;
+
+		nodes.push_back(node);
+		rebuild();
+
+		return true;
+	}
+
+	void rebuild()
+	{
+		ring.clear();
+		ring.reserve(nodes.size() * replicas);
+
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			for (size_t replica = 0; replica < replicas; replica++)
+			{
+				uint64_t seed = hash64(&replica, sizeof(replica));
+
+				ring.push_back(std::make_pair(hash64(nodes[i].endpoint.data(), nodes[i].endpoint.size(), seed), i));
+			}
+		}
+
+		std::sort(ring.begin(), ring.end());
 	}
 
+private:
+	Cluster(const Cluster&);
+	void operator=(const Cluster&);
+
 public:
-	UserControl user;
-	QueueControl queue;
-	RouteControl route;
-	ChannelControl channel;
+	QueueRouter queue;
+	RouteRouter route;
+	ChannelRouter channel;
 
 private:
-	Client(const Client&);
-	void operator=(const Client&);
+	size_t replicas;
+	std::vector<Node> nodes;
+	std::vector<std::pair<uint64_t, size_t> > ring;
+};
 
+class ConflatingPublisher
+{
 private:
-	emq_client *client;
+	struct Value
+	{
+		size_t size;
+		char data[1];
+	};
+
+	struct Slot
+	{
+		std::atomic<uint64_t> key;
+		std::atomic<bool> ready;
+		std::atomic<Value*> value;
+		std::string name;
+		std::string topic;
+	};
+
+public:
+	ConflatingPublisher(size_t capacity = 1024, Time retry_delay = 100) :
+		mask(table_size(capacity) - 1), slots(new Slot[mask + 1]), published(0), conflated(0), sent(0),
+		failed(0), retry_delay(retry_delay ? retry_delay : 1), retry_at(0), running(false)
+	{
+		for (size_t i = 0; i <= mask; i++)
+		{
+			slots[i].key = 0;
+			slots[i].ready = false;
+			slots[i].value = NULL;
+		}
+	}
+
+	~ConflatingPublisher()
+	{
+		stop();
+
+		for (size_t i = 0; i <= mask; i++)
+		{
+			release(slots[i].value.exchange(NULL));
+		}
+
+		delete[] slots;
+	}
+
+	inline bool publish(const std::string &name, const std::string &topic, const void *data, size_t size)
+	{
+		Slot *slot = find(name, topic);
+		Value *value;
+
+		if (!slot)
+		{
+			return false;
+		}
+
+		value = (Value*)::operator new(offsetof(Value, data) + size + 1);
+		value->size = size;
+		memcpy(value->data, data, size);
+
+		value = slot->value.exchange(value, std::memory_order_acq_rel);
+		published.fetch_add(1, std::memory_order_relaxed);
+
+		/* a slot that already held a value is on a dirty or retry list, only an empty one is queued */
+		if (value)
+		{
+			release(value);
+			conflated.fetch_add(1, std::memory_order_relaxed);
+			return true;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+
+		dirty.push_back(slot - slots);
+		cond.notify_one();
+
+		return true;
+	}
+
+	inline bool publish(const std::string &name, const std::string &topic, Message &message)
+	{
+		return publish(name, topic, message.data(), message.size());
+	}
+
+	inline size_t flush(Client &client)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			dirty.insert(dirty.end(), retry.begin(), retry.end());
+			retry.clear();
+		}
+
+		return drain(client);
+	}
+
+	inline void start(Client &client)
+	{
+		if (running)
+		{
+			return;
+		}
+
+		running = true;
+		thread = std::thread(&ConflatingPublisher::run, this, &client);
+	}
+
+	inline void stop()
+	{
+		if (!running)
+		{
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			running = false;
+			cond.notify_one();
+		}
+
+		thread.join();
+	}
+
+	inline uint64_t published_count()
+	{
+		return published;
+	}
+
+	inline uint64_t conflated_count()
+	{
+		return conflated;
+	}
+
+	inline uint64_t sent_count()
+	{
+		return sent;
+	}
+
+	inline uint64_t failed_count()
+	{
+		return failed;
+	}
+
+private:
+	static size_t table_size(size_t capacity)
+	{
+		size_t size = 16;
+
+		while (size < capacity * 2)
+		{
+			size <<= 1;
+		}
+
+		return size;
+	}
+
+	static void release(Value *value)
+	{
+		::operator delete(value);
+	}
+
+	Slot *find(const std::string &name, const std::string &topic)
+	{
+		uint64_t key = hash64(topic.data(), topic.size(), hash64(name.data(), name.size())) | 1;
+
+		for (size_t i = 0, index = key & mask; i <= mask; i++, index = (index + 1) & mask)
+		{
+			Slot &slot = slots[index];
+			uint64_t current = slot.key.load(std::memory_order_acquire);
+
+			if (!current && slot.key.compare_exchange_strong(current, key, std::memory_order_acq_rel))
+			{
+				slot.name = name;
+				slot.topic = topic;
+				slot.ready.store(true, std::memory_order_release);
+
+				return &slot;
+			}
+
+			if (current != key)
+			{
+				continue;
+			}
+
+			while (!slot.ready.load(std::memory_order_acquire))
+			{
+				std::this_thread::yield();
+			}
+
+			if (slot.name == name && slot.topic == topic)
+			{
+				return &slot;
+			}
+		}
+
+		return NULL;
+	}
+
+	size_t drain(Client &client)
+	{
+		std::vector<size_t> list;
+		size_t count = 0;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			list.swap(dirty);
+		}
+
+		for (size_t i = 0; i < list.size(); i++)
+		{
+			Slot &slot = slots[list[i]];
+			Value *value = slot.value.exchange(NULL, std::memory_order_acq_rel);
+			Value *empty = NULL;
+
+			if (!value)
+			{
+				continue;
+			}
+
+			Message message(value->data, value->size, true);
+
+			if (client.channel.publish(slot.name, slot.topic, message))
+			{
+				sent.fetch_add(1, std::memory_order_relaxed);
+				release(value);
+				count++;
+				continue;
+			}
+
+			failed.fetch_add(1, std::memory_order_relaxed);
+
+			/* put the value back unless a newer one arrived meanwhile, which is then already queued */
+			if (!slot.value.compare_exchange_strong(empty, value, std::memory_order_acq_rel))
+			{
+				release(value);
+				continue;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+
+			if (retry.empty())
+			{
+				retry_at = monotonic_time() + retry_delay;
+			}
+
+			retry.push_back(list[i]);
+		}
+
+		return count;
+	}
+
+	void run(Client *client)
+	{
+		while (running)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+
+				cond.wait_for(lock, std::chrono::milliseconds(retry.empty() ? 1000 : retry_delay), [this]()
+				{
+					return !running || !dirty.empty();
+				});
+
+				if (!retry.empty() && monotonic_time() >= retry_at)
+				{
+					dirty.insert(dirty.end(), retry.begin(), retry.end());
+					retry.clear();
+				}
+			}
+
+			drain(*client);
+		}
+
+		flush(*client);
+	}
+
+private:
+	ConflatingPublisher(const ConflatingPublisher&);
+	void operator=(const ConflatingPublisher&);
+
+private:
+	size_t mask;
+	Slot *slots;
+	std::atomic<uint64_t> published;
+	std::atomic<uint64_t> conflated;
+	std::atomic<uint64_t> sent;
+	std::atomic<uint64_t> failed;
+	Time retry_delay;
+	uint64_t retry_at;
+	std::vector<size_t> dirty;
+	std::vector<size_t> retry;
+	std::atomic<bool> running;
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable cond;
 };
 
 static bool compatible()
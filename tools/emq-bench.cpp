@@ -0,0 +1,578 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <random>
+
+#include <getopt.h>
+
+#include "emq++.h"
+
+#define DEFAULT_ADDR "localhost"
+#define PREFIX "emq-bench"
+
+enum Mode
+{
+	MODE_QUEUE,
+	MODE_ROUTE,
+	MODE_CHANNEL
+};
+
+struct Config
+{
+	std::string addr;
+	int port;
+	std::string path;
+	std::string user;
+	std::string password;
+	Mode mode;
+	size_t producers;
+	size_t consumers;
+	size_t targets;
+	size_t min_size;
+	size_t max_size;
+	bool exponential;
+	double duration;
+	double rate;
+	bool json;
+	bool keep;
+};
+
+struct Stats
+{
+	Stats() : operations(0), errors(0), bytes(0)
+	{
+	}
+
+	EMQ::Histogram latency;
+	uint64_t operations;
+	uint64_t errors;
+	uint64_t bytes;
+};
+
+static std::atomic<bool> running(true);
+static std::atomic<uint64_t> channel_received(0);
+static std::mutex channel_mutex;
+static EMQ::Histogram channel_latency;
+
+static uint64_t now_usec()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static std::string target(size_t index)
+{
+	std::ostringstream out;
+
+	out << PREFIX << "." << index;
+
+	return out.str();
+}
+
+static EMQ::Client *connect(const Config &config)
+{
+	EMQ::Client *client = config.path.empty() ? new EMQ::Client(config.addr, config.port) :
+		new EMQ::Client(config.path);
+
+	if (!client->connected() || (!config.user.empty() && !client->auth(config.user, config.password)))
+	{
+		delete client;
+		return NULL;
+	}
+
+	return client;
+}
+
+static bool setup(EMQ::Client &client, const Config &config)
+{
+	EMQ::Topology topology;
+
+	for (size_t i = 0; i < config.targets; i++)
+	{
+		if (config.mode == MODE_CHANNEL)
+		{
+			topology.channel(target(i), EMQ_CHANNEL_NONE);
+		}
+		else
+		{
+			topology.queue(target(i), EMQ_MAX_MSG, EMQ_MAX_MSG_SIZE, EMQ_QUEUE_NONE);
+		}
+
+		if (config.mode == MODE_ROUTE)
+		{
+			topology.bind(PREFIX, target(i), target(i));
+		}
+	}
+
+	if (config.mode == MODE_ROUTE)
+	{
+		topology.route(PREFIX, EMQ_ROUTE_NONE);
+	}
+
+	return topology.apply(client);
+}
+
+static void cleanup(EMQ::Client &client, const Config &config)
+{
+	for (size_t i = 0; i < config.targets; i++)
+	{
+		if (config.mode == MODE_CHANNEL)
+		{
+			client.channel.remove(target(i));
+		}
+		else
+		{
+			client.queue.remove(target(i));
+		}
+	}
+
+	if (config.mode == MODE_ROUTE)
+	{
+		client.route.remove(PREFIX);
+	}
+}
+
+static void producer(const Config &config, size_t id, Stats *stats)
+{
+	EMQ::Client *client = connect(config);
+	std::mt19937_64 random(id + 1);
+	std::exponential_distribution<double> distribution(1.0 / std::max<size_t>(config.min_size, 1));
+	std::vector<char> payload(std::max<size_t>(config.max_size, sizeof(uint64_t)), 'x');
+	double interval = config.rate > 0 ? 1e6 * config.producers / config.rate : 0;
+	uint64_t next = now_usec();
+	size_t index = id;
+
+	if (!client)
+	{
+		stats->errors++;
+		return;
+	}
+
+	while (running)
+	{
+		std::string name = target(index++ % config.targets);
+		size_t size = config.min_size;
+		uint64_t begin;
+		bool status;
+
+		if (config.exponential)
+		{
+			size = std::min<size_t>((size_t)distribution(random), config.max_size);
+		}
+		else if (config.max_size > config.min_size)
+		{
+			size = config.min_size + random() % (config.max_size - config.min_size + 1);
+		}
+
+		size = std::max<size_t>(size, sizeof(uint64_t));
+
+		if (interval > 0)
+		{
+			uint64_t now = now_usec();
+
+			if (next > now)
+			{
+				std::this_thread::sleep_for(std::chrono::microseconds(next - now));
+			}
+
+			next += (uint64_t)interval;
+		}
+
+		begin = now_usec();
+		memcpy(&payload[0], &begin, sizeof(begin));
+
+		EMQ::Message message(&payload[0], size, true);
+
+		switch (config.mode)
+		{
+			case MODE_QUEUE:
+				status = client->queue.push(name, message);
+				break;
+			case MODE_ROUTE:
+				status = client->route.push(PREFIX, name, message);
+				break;
+			default:
+				status = client->channel.publish(name, "bench", message);
+				break;
+		}
+
+		stats->latency.add(now_usec() - begin);
+		stats->operations++;
+
+		if (status)
+		{
+			stats->bytes += size;
+		}
+		else
+		{
+			stats->errors++;
+		}
+	}
+
+	client->disconnect();
+	delete client;
+}
+
+static void consumer(const Config &config, size_t id, Stats *stats)
+{
+	EMQ::Client *client = connect(config);
+	size_t index = id;
+
+	if (!client)
+	{
+		stats->errors++;
+		return;
+	}
+
+	while (running)
+	{
+		EMQ::Message message = client->queue.pop(target(index++ % config.targets), 0);
+		uint64_t sent;
+
+		if (!message.msg())
+		{
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			continue;
+		}
+
+		if (message.size() >= sizeof(sent))
+		{
+			memcpy(&sent, message.data(), sizeof(sent));
+			stats->latency.add(now_usec() - sent);
+		}
+
+		stats->operations++;
+		stats->bytes += message.size();
+	}
+
+	client->disconnect();
+	delete client;
+}
+
+static int channel_callback(emq_client *_client, int, const char *name, const char *topic, const char *, emq_msg *msg)
+{
+	EMQ::Message message(msg);
+	uint64_t sent;
+
+	if (message.size() >= sizeof(sent))
+	{
+		std::lock_guard<std::mutex> lock(channel_mutex);
+
+		memcpy(&sent, message.data(), sizeof(sent));
+		channel_latency.add(now_usec() - sent);
+		channel_received++;
+	}
+
+	if (!running)
+	{
+		EMQ::Client client(_client);
+
+		client.set_noack_mode(true);
+		client.channel.unsubscribe(name, topic);
+		client.set_noack_mode(false);
+
+		return 1;
+	}
+
+	return 0;
+}
+
+static void subscriber(const Config &config, Stats *stats, EMQ::Client **handle)
+{
+	EMQ::Client *client = connect(config);
+
+	if (!client)
+	{
+		stats->errors++;
+		return;
+	}
+
+	for (size_t i = 0; i < config.targets; i++)
+	{
+		client->channel.subscribe(target(i), "bench", channel_callback);
+	}
+
+	*handle = client;
+	client->process();
+}
+
+static void report(const Config &config, double elapsed, const Stats &sent, const Stats &received)
+{
+	static const double percentiles[] = { 50, 90, 99, 99.9 };
+	const char *mode = config.mode == MODE_QUEUE ? "queue" : config.mode == MODE_ROUTE ? "route" : "channel";
+
+	if (config.json)
+	{
+		std::cout << "{\"mode\":\"" << mode << "\",\"producers\":" << config.producers
+			<< ",\"consumers\":" << config.consumers << ",\"elapsed\":" << elapsed
+			<< ",\"sent\":" << sent.operations << ",\"errors\":" << sent.errors
+			<< ",\"received\":" << received.operations
+			<< ",\"send_rate\":" << sent.operations / elapsed
+			<< ",\"receive_rate\":" << received.operations / elapsed
+			<< ",\"send_mbps\":" << sent.bytes / elapsed / 1e6;
+
+		for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+		{
+			std::cout << ",\"push_p" << percentiles[i] << "\":" << sent.latency.percentile(percentiles[i]);
+			std::cout << ",\"e2e_p" << percentiles[i] << "\":" << received.latency.percentile(percentiles[i]);
+		}
+
+		std::cout << ",\"push_max\":" << sent.latency.max() << ",\"e2e_max\":" << received.latency.max()
+			<< "}" << std::endl;
+	}
+	else
+	{
+		std::cout << "mode,producers,consumers,elapsed,sent,errors,received,send_rate,receive_rate,send_mbps";
+
+		for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+		{
+			std::cout << ",push_p" << percentiles[i] << ",e2e_p" << percentiles[i];
+		}
+
+		std::cout << ",push_max,e2e_max" << std::endl;
+
+		std::cout << mode << "," << config.producers << "," << config.consumers << "," << elapsed
+			<< "," << sent.operations << "," << sent.errors << "," << received.operations
+			<< "," << sent.operations / elapsed << "," << received.operations / elapsed
+			<< "," << sent.bytes / elapsed / 1e6;
+
+		for (size_t i = 0; i < sizeof(percentiles) / sizeof(percentiles[0]); i++)
+		{
+			std::cout << "," << sent.latency.percentile(percentiles[i])
+				<< "," << received.latency.percentile(percentiles[i]);
+		}
+
+		std::cout << "," << sent.latency.max() << "," << received.latency.max() << std::endl;
+	}
+}
+
+static void usage(const char *name)
+{
+	std::cout << "Usage: " << name << " [options]" << std::endl;
+	std::cout << " -h <addr>        Server address (default: " << DEFAULT_ADDR << ")" << std::endl;
+	std::cout << " -p <port>        Server port (default: " << EMQ_DEFAULT_PORT << ")" << std::endl;
+	std::cout << " -u <path>        Unix socket path (overrides -h/-p)" << std::endl;
+	std::cout << " -a <user:pass>   Authenticate every connection" << std::endl;
+	std::cout << " -m <mode>        queue, route or channel (default: queue)" << std::endl;
+	std::cout << " -P <producers>   Producer connections (default: 1)" << std::endl;
+	std::cout << " -C <consumers>   Consumer connections (default: 1)" << std::endl;
+	std::cout << " -n <targets>     Queues/channels to spread load over (default: 1)" << std::endl;
+	std::cout << " -s <size>        Message size: N, MIN-MAX (uniform) or eN (exponential mean)" << std::endl;
+	std::cout << " -r <rate>        Total target send rate in msg/s, 0 = unlimited (default: 0)" << std::endl;
+	std::cout << " -d <seconds>     Duration (default: 10)" << std::endl;
+	std::cout << " -j               Output JSON instead of CSV" << std::endl;
+	std::cout << " -k               Keep benchmark queues, routes and channels" << std::endl;
+}
+
+static bool parse_size(const std::string &value, Config *config)
+{
+	size_t dash = value.find('-');
+
+	config->exponential = !value.empty() && value[0] == 'e';
+
+	if (config->exponential)
+	{
+		config->min_size = atol(value.c_str() + 1);
+		config->max_size = config->min_size * 16;
+	}
+	else if (dash != std::string::npos)
+	{
+		config->min_size = atol(value.substr(0, dash).c_str());
+		config->max_size = atol(value.substr(dash + 1).c_str());
+	}
+	else
+	{
+		config->min_size = config->max_size = atol(value.c_str());
+	}
+
+	return config->min_size > 0 && config->max_size >= config->min_size;
+}
+
+int main(int argc, char *argv[])
+{
+	Config config;
+	std::vector<std::thread> threads;
+	std::vector<Stats> producer_stats, consumer_stats;
+	std::vector<EMQ::Client*> subscribers;
+	Stats sent, received;
+	EMQ::Client *client;
+	double elapsed;
+	int opt;
+
+	config.addr = DEFAULT_ADDR;
+	config.port = EMQ_DEFAULT_PORT;
+	config.mode = MODE_QUEUE;
+	config.producers = 1;
+	config.consumers = 1;
+	config.targets = 1;
+	config.min_size = config.max_size = 64;
+	config.exponential = false;
+	config.duration = 10;
+	config.rate = 0;
+	config.json = false;
+	config.keep = false;
+
+	while ((opt = getopt(argc, argv, "h:p:u:a:m:P:C:n:s:r:d:jk")) != -1)
+	{
+		switch (opt)
+		{
+			case 'h':
+				config.addr = optarg;
+				break;
+			case 'p':
+				config.port = atoi(optarg);
+				break;
+			case 'u':
+				config.path = optarg;
+				break;
+			case 'a':
+				config.user = optarg;
+				config.password = config.user.find(':') != std::string::npos ?
+					config.user.substr(config.user.find(':') + 1) : "";
+				config.user = config.user.substr(0, config.user.find(':'));
+				break;
+			case 'm':
+				config.mode = std::string(optarg) == "route" ? MODE_ROUTE :
+					std::string(optarg) == "channel" ? MODE_CHANNEL : MODE_QUEUE;
+				break;
+			case 'P':
+				config.producers = atoi(optarg);
+				break;
+			case 'C':
+				config.consumers = atoi(optarg);
+				break;
+			case 'n':
+				config.targets = std::max(atoi(optarg), 1);
+				break;
+			case 's':
+				if (!parse_size(optarg, &config))
+				{
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'r':
+				config.rate = atof(optarg);
+				break;
+			case 'd':
+				config.duration = atof(optarg);
+				break;
+			case 'j':
+				config.json = true;
+				break;
+			case 'k':
+				config.keep = true;
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (!EMQ::compatible())
+	{
+		std::cerr << "Warning: used incompatible version libemq" << std::endl;
+	}
+
+	client = connect(config);
+	if (!client)
+	{
+		std::cerr << "Error connect to server" << std::endl;
+		return 1;
+	}
+
+	if (!setup(*client, config))
+	{
+		std::cerr << "Error create benchmark topology: " << client->last_error() << std::endl;
+		return 1;
+	}
+
+	producer_stats.resize(config.producers);
+	consumer_stats.resize(config.consumers);
+	subscribers.resize(config.consumers, NULL);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < config.consumers; i++)
+	{
+		if (config.mode == MODE_CHANNEL)
+		{
+			threads.push_back(std::thread(subscriber, std::cref(config), &consumer_stats[i], &subscribers[i]));
+		}
+		else
+		{
+			threads.push_back(std::thread(consumer, std::cref(config), i, &consumer_stats[i]));
+		}
+	}
+
+	for (size_t i = 0; i < config.producers; i++)
+	{
+		threads.push_back(std::thread(producer, std::cref(config), i, &producer_stats[i]));
+	}
+
+	std::this_thread::sleep_for(std::chrono::milliseconds((int64_t)(config.duration * 1000)));
+	running = false;
+
+	if (config.mode == MODE_CHANNEL)
+	{
+		EMQ::Message wakeup((void*)"", 1, true);
+
+		for (size_t i = 0; i < config.targets; i++)
+		{
+			client->channel.publish(target(i), "bench", wakeup);
+		}
+	}
+
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+
+	elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	for (size_t i = 0; i < producer_stats.size(); i++)
+	{
+		sent.latency.merge(producer_stats[i].latency);
+		sent.operations += producer_stats[i].operations;
+		sent.errors += producer_stats[i].errors;
+		sent.bytes += producer_stats[i].bytes;
+	}
+
+	for (size_t i = 0; i < consumer_stats.size(); i++)
+	{
+		received.latency.merge(consumer_stats[i].latency);
+		received.operations += consumer_stats[i].operations;
+		received.errors += consumer_stats[i].errors;
+		received.bytes += consumer_stats[i].bytes;
+	}
+
+	if (config.mode == MODE_CHANNEL)
+	{
+		received.latency.merge(channel_latency);
+		received.operations += channel_received;
+
+		for (size_t i = 0; i < subscribers.size(); i++)
+		{
+			if (subscribers[i])
+			{
+				subscribers[i]->disconnect();
+				delete subscribers[i];
+			}
+		}
+	}
+
+	report(config, elapsed, sent, received);
+
+	if (!config.keep)
+	{
+		cleanup(*client, config);
+	}
+
+	client->disconnect();
+	delete client;
+
+	return 0;
+}
@@ -0,0 +1,377 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <thread>
+
+#include <getopt.h>
+
+#include "emq++.h"
+
+#define DEFAULT_ADDR "localhost"
+
+struct Operation
+{
+	EMQ::Recorder::Record record;
+	std::string name;
+	std::string key;
+	std::vector<char> data;
+};
+
+struct Result
+{
+	EMQ::Histogram latency;
+	uint64_t operations;
+	uint64_t errors;
+	uint64_t mismatches;
+};
+
+static void usage(const char *name)
+{
+	std::cout << "Usage: " << name << " [options] <capture>" << std::endl;
+	std::cout << " -h <addr>        Server address (default: " << DEFAULT_ADDR << ")" << std::endl;
+	std::cout << " -p <port>        Server port (default: " << EMQ_DEFAULT_PORT << ")" << std::endl;
+	std::cout << " -u <path>        Unix socket path (overrides -h/-p)" << std::endl;
+	std::cout << " -a <user:pass>   Authenticate every connection" << std::endl;
+	std::cout << " -s <speed>       Replay speed factor, 0 = as fast as possible (default: 1)" << std::endl;
+	std::cout << " -c <connections> Number of connections (default: 1)" << std::endl;
+}
+
+static void split(const std::string &binding, std::string *queue, std::string *key)
+{
+	size_t separator = binding.find('\0');
+
+	*queue = binding.substr(0, separator);
+	*key = separator != std::string::npos ? binding.substr(separator + 1) : std::string();
+}
+
+static int discard(emq_client *client, int type, const char *name, const char *topic, const char *pattern,
+	emq_msg *msg)
+{
+	(void)client;
+	(void)type;
+	(void)name;
+	(void)topic;
+	(void)pattern;
+
+	if (msg)
+	{
+		emq_msg_release(msg);
+	}
+
+	return 0;
+}
+
+static bool execute(EMQ::Client &client, Operation &operation, std::vector<char> &payload,
+	std::map<std::string, EMQ::Tag> &tags, const std::string &password)
+{
+	const EMQ::Recorder::Record &record = operation.record;
+	int value;
+	char *data;
+
+	if (operation.data.empty() && payload.size() < record.data_size)
+	{
+		payload.resize(record.data_size, 'x');
+	}
+
+	data = operation.data.empty() ? (payload.empty() ? NULL : &payload[0]) : &operation.data[0];
+
+	switch (record.operation)
+	{
+		case EMQ::Recorder::QUEUE_CREATE:
+			return client.queue.create(operation.name, record.arguments[0], record.arguments[1],
+				record.arguments[2]);
+		case EMQ::Recorder::QUEUE_DECLARE:
+			return client.queue.declare(operation.name);
+		case EMQ::Recorder::QUEUE_PURGE:
+			return client.queue.purge(operation.name);
+		case EMQ::Recorder::QUEUE_REMOVE:
+			return client.queue.remove(operation.name);
+		case EMQ::Recorder::QUEUE_EXIST:
+			return client.queue.exist(operation.name, &value);
+		case EMQ::Recorder::QUEUE_LIST:
+		{
+			std::vector<EMQ::Queue> list;
+
+			return client.queue.list(list);
+		}
+		case EMQ::Recorder::QUEUE_RENAME:
+			return client.queue.rename(operation.name, operation.key);
+		case EMQ::Recorder::QUEUE_SIZE:
+			return client.queue.size(operation.name, &value);
+		case EMQ::Recorder::QUEUE_SUBSCRIBE:
+			return client.queue.subscribe(operation.name, record.arguments[0], discard);
+		case EMQ::Recorder::QUEUE_UNSUBSCRIBE:
+			return client.queue.unsubscribe(operation.name);
+		case EMQ::Recorder::QUEUE_PUSH:
+		{
+			EMQ::Message message(data, record.data_size, true);
+
+			return client.queue.push(operation.name, message);
+		}
+		case EMQ::Recorder::QUEUE_GET:
+		{
+			EMQ::Message message = client.queue.get(operation.name);
+
+			return message.msg() != NULL;
+		}
+		case EMQ::Recorder::QUEUE_POP:
+		{
+			EMQ::Message message = client.queue.pop(operation.name, record.arguments[0]);
+
+			if (message.msg())
+			{
+				tags[operation.name] = message.tag();
+			}
+
+			return message.msg() != NULL;
+		}
+		case EMQ::Recorder::QUEUE_CONFIRM:
+			return client.queue.confirm(operation.name, tags[operation.name]);
+		case EMQ::Recorder::ROUTE_CREATE:
+			return client.route.create(operation.name, record.arguments[0]);
+		case EMQ::Recorder::ROUTE_BIND:
+		{
+			std::string queue, key;
+
+			split(operation.key, &queue, &key);
+
+			return client.route.bind(operation.name, queue, key);
+		}
+		case EMQ::Recorder::ROUTE_UNBIND:
+		{
+			std::string queue, key;
+
+			split(operation.key, &queue, &key);
+
+			return client.route.unbind(operation.name, queue, key);
+		}
+		case EMQ::Recorder::ROUTE_REMOVE:
+			return client.route.remove(operation.name);
+		case EMQ::Recorder::ROUTE_EXIST:
+			return client.route.exist(operation.name, &value);
+		case EMQ::Recorder::ROUTE_LIST:
+		{
+			std::vector<EMQ::Route> list;
+
+			return client.route.list(list);
+		}
+		case EMQ::Recorder::ROUTE_KEYS:
+		{
+			std::vector<EMQ::RouteKey> list;
+
+			return client.route.keys(operation.name, list);
+		}
+		case EMQ::Recorder::ROUTE_RENAME:
+			return client.route.rename(operation.name, operation.key);
+		case EMQ::Recorder::ROUTE_PUSH:
+		{
+			EMQ::Message message(data, record.data_size, true);
+
+			return client.route.push(operation.name, operation.key, message);
+		}
+		case EMQ::Recorder::CHANNEL_CREATE:
+			return client.channel.create(operation.name, record.arguments[0]);
+		case EMQ::Recorder::CHANNEL_REMOVE:
+			return client.channel.remove(operation.name);
+		case EMQ::Recorder::CHANNEL_EXIST:
+			return client.channel.exist(operation.name, &value);
+		case EMQ::Recorder::CHANNEL_LIST:
+		{
+			std::vector<EMQ::Channel> list;
+
+			return client.channel.list(list);
+		}
+		case EMQ::Recorder::CHANNEL_RENAME:
+			return client.channel.rename(operation.name, operation.key);
+		case EMQ::Recorder::CHANNEL_SUBSCRIBE:
+			return client.channel.subscribe(operation.name, operation.key, discard);
+		case EMQ::Recorder::CHANNEL_PSUBSCRIBE:
+			return client.channel.psubscribe(operation.name, operation.key, discard);
+		case EMQ::Recorder::CHANNEL_UNSUBSCRIBE:
+			return client.channel.unsubscribe(operation.name, operation.key);
+		case EMQ::Recorder::CHANNEL_PUNSUBSCRIBE:
+			return client.channel.punsubscribe(operation.name, operation.key);
+		case EMQ::Recorder::PING:
+			return client.ping();
+		case EMQ::Recorder::AUTH:
+			/* passwords are not captured: replay the login with the -a credentials */
+			return client.auth(operation.name, password);
+		case EMQ::Recorder::CHANNEL_PUBLISH:
+		{
+			EMQ::Message message(data, record.data_size, true);
+
+			return client.channel.publish(operation.name, operation.key, message);
+		}
+	}
+
+	return false;
+}
+
+static void worker(const std::string &addr, int port, const std::string &path, const std::string &user,
+	const std::string &password, double speed, std::vector<Operation*> operations, Result *result)
+{
+	EMQ::Client *client = path.empty() ? new EMQ::Client(addr, port) : new EMQ::Client(path);
+	std::map<std::string, EMQ::Tag> tags;
+	std::vector<char> payload;
+	std::chrono::steady_clock::time_point start;
+
+	result->operations = 0;
+	result->errors = 0;
+	result->mismatches = 0;
+
+	if (!client->connected() || (!user.empty() && !client->auth(user, password)))
+	{
+		std::cerr << "Error connect to server" << std::endl;
+		result->errors = operations.size();
+		delete client;
+		return;
+	}
+
+	start = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < operations.size(); i++)
+	{
+		Operation &operation = *operations[i];
+		std::chrono::steady_clock::time_point begin;
+
+		if (speed > 0)
+		{
+			std::this_thread::sleep_until(start +
+				std::chrono::microseconds((uint64_t)(operation.record.timestamp / speed)));
+		}
+
+		begin = std::chrono::steady_clock::now();
+
+		if (execute(*client, operation, payload, tags, password) != (operation.record.status != 0))
+		{
+			result->mismatches++;
+		}
+
+		result->latency.add(std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - begin).count());
+		result->operations++;
+	}
+
+	client->disconnect();
+	delete client;
+}
+
+int main(int argc, char *argv[])
+{
+	std::string addr = DEFAULT_ADDR, path, user, password;
+	int port = EMQ_DEFAULT_PORT;
+	size_t connections = 1;
+	double speed = 1;
+	std::vector<Operation> operations;
+	std::vector<std::vector<Operation*> > partitions;
+	std::vector<Result> results;
+	std::vector<std::thread> threads;
+	EMQ::Recorder::Reader reader;
+	EMQ::Histogram latency;
+	uint64_t total = 0, errors = 0, mismatches = 0;
+	double elapsed;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "h:p:u:a:s:c:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'h':
+				addr = optarg;
+				break;
+			case 'p':
+				port = atoi(optarg);
+				break;
+			case 'u':
+				path = optarg;
+				break;
+			case 'a':
+				user = optarg;
+				password = user.find(':') != std::string::npos ? user.substr(user.find(':') + 1) : "";
+				user = user.substr(0, user.find(':'));
+				break;
+			case 's':
+				speed = atof(optarg);
+				break;
+			case 'c':
+				connections = std::max(atoi(optarg), 1);
+				break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (!EMQ::compatible())
+	{
+		std::cerr << "Warning: used incompatible version libemq" << std::endl;
+	}
+
+	if (!reader.open(argv[optind]))
+	{
+		std::cerr << "Error open capture " << argv[optind] << std::endl;
+		return 1;
+	}
+
+	while (true)
+	{
+		Operation operation;
+
+		if (!reader.next(&operation.record, &operation.name, &operation.key, &operation.data))
+		{
+			break;
+		}
+
+		operations.push_back(operation);
+	}
+
+	partitions.resize(connections);
+	results.resize(connections);
+
+	for (size_t i = 0; i < operations.size(); i++)
+	{
+		Operation &operation = operations[i];
+
+		partitions[EMQ::hash64(operation.name.data(), operation.name.size()) % connections].push_back(&operation);
+	}
+
+	std::cout << "Replaying " << operations.size() << " operations over " << connections
+		<< " connection(s)" << std::endl;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	for (size_t i = 0; i < connections; i++)
+	{
+		threads.push_back(std::thread(worker, addr, port, path, user, password, speed, partitions[i], &results[i]));
+	}
+
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+
+		latency.merge(results[i].latency);
+		total += results[i].operations;
+		errors += results[i].errors;
+		mismatches += results[i].mismatches;
+	}
+
+	elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	std::cout << "Operations: " << total << std::endl;
+	std::cout << "Errors: " << errors << std::endl;
+	std::cout << "Mismatches: " << mismatches << std::endl;
+	std::cout << "Elapsed: " << elapsed << " s" << std::endl;
+	std::cout << "Throughput: " << (elapsed > 0 ? total / elapsed : 0) << " ops/s" << std::endl;
+	std::cout << "Latency p50: " << latency.percentile(50) << " us" << std::endl;
+	std::cout << "Latency p90: " << latency.percentile(90) << " us" << std::endl;
+	std::cout << "Latency p99: " << latency.percentile(99) << " us" << std::endl;
+	std::cout << "Latency max: " << latency.max() << " us" << std::endl;
+
+	return errors || mismatches ? 1 : 0;
+}